@@ -0,0 +1,807 @@
+
+// Benchmarks. Run as
+//
+//   cashew-bench BENCHMARK [input.js]
+//
+// Without an input file, a large asm.js module is generated.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_set>
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include "simple_ast.h"
+
+// Utilities
+
+static double now() {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static std::string readFile(const char *filename) {
+  FILE *f = fopen(filename, "r");
+  if (!f) {
+    printf("could not open %s\n", filename);
+    abort();
+  }
+  fseek(f, 0, SEEK_END);
+  int size = ftell(f);
+  std::string ret(size, 0);
+  rewind(f);
+  if (fread(&ret[0], 1, size, f) != size_t(size)) {
+    printf("could not read %s\n", filename);
+    abort();
+  }
+  fclose(f);
+  return ret;
+}
+
+// Generates something that looks like emscripten output: a module function containing many functions
+static std::string generateModule(int functions) {
+  std::string ret = "function asmModule(global, env, buffer) {\n"
+                    "  \"use asm\";\n"
+                    "\n"
+                    "  var HEAP32 = new global.Int32Array(buffer);\n"
+                    "  var HEAPF64 = new global.Float64Array(buffer);\n"
+                    "  var Math_imul = global.Math.imul;\n"
+                    "  var STACKTOP = env.STACKTOP | 0;\n"
+                    "\n";
+  char buffer[2048];
+  for (int i = 0; i < functions; i++) {
+    snprintf(buffer, sizeof(buffer),
+      "  function _func%d($a, $b, $c) {\n"
+      "    $a = $a | 0;\n"
+      "    $b = +$b;\n"
+      "    $c = $c | 0;\n"
+      "    var $i = 0, $j = 0, $sum = 0.0, sp = 0;\n"
+      "    sp = STACKTOP; // save the stack\n"
+      "    STACKTOP = STACKTOP + 16 | 0;\n"
+      "    /* walk the array, summing */\n"
+      "    L%d: while (1) {\n"
+      "      if (($i | 0) >= ($c | 0)) {\n"
+      "        break L%d;\n"
+      "      }\n"
+      "      $j = HEAP32[$a + ($i << 2) >> 2] | 0;\n"
+      "      $sum = $sum + +HEAPF64[$a + ($j << 3) >> 3] * $b;\n"
+      "      $i = $i + 1 | 0;\n"
+      "    }\n"
+      "    switch ($c | 0) {\n"
+      "      case 0: {\n"
+      "        $sum = $sum + 1.5;\n"
+      "        break;\n"
+      "      }\n"
+      "      case -1: $sum = -$sum; break;\n"
+      "      default: $sum = $sum * 0.25;\n"
+      "    }\n"
+      "    HEAP32[sp >> 2] = Math_imul($i, %d) | 0;\n"
+      "    STACKTOP = sp;\n"
+      "    return ($c | 0) > 0 ? ~~$sum : _func%d($a, $b, $c - 1 | 0) | 0;\n"
+      "  }\n"
+      "\n",
+      i, i, i, i * 7 + 3, i > 0 ? i - 1 : 0);
+    ret += buffer;
+  }
+  ret += "  return { _func0: _func0 };\n"
+         "}\n";
+  return ret;
+}
+
+// Bytes currently allocated by malloc, where we can tell
+static size_t allocatedBytes() {
+#ifdef __GLIBC__
+  struct mallinfo2 info = mallinfo2();
+  return info.uordblks + info.hblkhd; // hblkhd counts large allocations, which are mmapped
+#else
+  return 0;
+#endif
+}
+
+// Random numeric literals of the kinds seen in asm.js, and harder ones: long mantissas, large exponents,
+// and hex beyond 64 bits
+static std::string randomNumber(std::mt19937_64& random) {
+  char buffer[128];
+  switch (random() % 8) {
+    case 0: snprintf(buffer, sizeof(buffer), "%u", unsigned(random() % 1024)); break;
+    case 1: snprintf(buffer, sizeof(buffer), "%u", unsigned(random())); break;
+    case 2: snprintf(buffer, sizeof(buffer), "%llu", (unsigned long long)random() >> (random() % 64)); break;
+    case 3: {
+      double x;
+      uint64_t bits = random() & ~(uint64_t(1) << 63);
+      memcpy(&x, &bits, sizeof(x));
+      if (x != x || x == INFINITY) x = 1;
+      snprintf(buffer, sizeof(buffer), "%.*g", int(random() % 18) + 1, x);
+      break;
+    }
+    case 4: snprintf(buffer, sizeof(buffer), "%.*f", int(random() % 6), double(random() % 100000) / 64); break;
+    case 5: {
+      // digits with a '.' somewhere and an exponent maybe
+      int digits = random() % 30 + 1, dot = random() % (digits + 1), i = 0;
+      for (int j = 0; j < digits; j++) {
+        if (j == dot) buffer[i++] = '.';
+        buffer[i++] = '0' + random() % 10;
+      }
+      if (random() % 2) i += snprintf(buffer + i, sizeof(buffer) - i, "e%d", int(random() % 700) - 350);
+      buffer[i] = 0;
+      break;
+    }
+    case 6: snprintf(buffer, sizeof(buffer), "%de%d", int(random() % 100), int(random() % 50) - 25); break;
+    case 7: {
+      int digits = random() % 24 + 1, i = 0;
+      buffer[i++] = '0';
+      buffer[i++] = random() % 2 ? 'x' : 'X';
+      for (int j = 0; j < digits; j++) buffer[i++] = "0123456789abcdefABCDEF"[random() % 22];
+      buffer[i] = 0;
+      break;
+    }
+  }
+  return buffer;
+}
+
+// Runs func on the input until enough time has passed, and reports the throughput
+template<class T>
+static void measure(const char *name, const std::string& input, T func) {
+  double total = 0;
+  int iterations = 0;
+  while (total < 1 || iterations < 3) {
+    double start = now();
+    func(input.c_str());
+    total += now() - start;
+    iterations++;
+  }
+  double perIteration = total / iterations;
+  printf("%-24s %10.3f ms  %10.2f MB/s\n", name, perIteration * 1000, input.size() / perIteration / (1024 * 1024));
+}
+
+// Benchmarks
+
+static void benchLex(const std::string& input) {
+  measure("lex", input, [](const char *src) {
+    cashew::FragStream frags;
+    frags.lex(src);
+  });
+  measure("parse", input, [](const char *src) {
+    cashew::Parser<Ref, ValueBuilder> parser;
+    parser.parseToplevel(src);
+  });
+  cashew::FragStream frags;
+  frags.lex(input.c_str());
+  measure("parse prelexed", input, [&](const char *src) {
+    cashew::Parser<Ref, ValueBuilder> parser;
+    parser.parseToplevel(src, &frags);
+  });
+}
+
+static void benchSkipSpace(const std::string& input) {
+  // find where each run of whitespace and comments starts, so we can measure just skipping those
+  std::vector<size_t> runs;
+  size_t skipped = 0;
+  cashew::useSkipSpaceImplementation("scalar");
+  for (const char *src = input.c_str(); *src; ) {
+    const char *next = cashew::skipSpaceAndComments(src);
+    if (next == src) {
+      src++;
+      continue;
+    }
+    runs.push_back(src - input.c_str());
+    skipped += next - src;
+    src = next;
+  }
+  printf("%.2f MB in %d runs of whitespace and comments\n", skipped / (1024. * 1024), int(runs.size()));
+  for (const char *implementation : { "scalar", "sse2", "avx2" }) {
+    if (!cashew::useSkipSpaceImplementation(implementation)) {
+      printf("%s is not supported\n", implementation);
+      continue;
+    }
+    std::string name = std::string("skip space: ") + implementation;
+    double start = now(), total;
+    int iterations = 0;
+    size_t check = 0;
+    do {
+      for (size_t run : runs) check += cashew::skipSpaceAndComments(&input[run]) - &input[run];
+      iterations++;
+      total = now() - start;
+    } while (total < 1 || iterations < 3);
+    if (check != skipped * iterations) {
+      printf("%s skips differently\n", implementation);
+      abort();
+    }
+    printf("%-24s %10.3f ms  %10.2f MB/s\n", name.c_str(), total / iterations * 1000, skipped * iterations / total / (1024 * 1024));
+    name = std::string("lex: ") + implementation;
+    measure(name.c_str(), input, [](const char *src) {
+      cashew::FragStream frags;
+      frags.lex(src);
+    });
+  }
+}
+
+static void benchNumbers(const std::string& input) {
+  // check against strtod first
+  std::mt19937_64 random(42);
+  const int CHECKS = 5000000;
+  for (int i = 0; i < CHECKS; i++) {
+    std::string number = randomNumber(random);
+    char *src = &number[0], *expectedEnd;
+    double expected = strtod(src, &expectedEnd), actual;
+    bool hasDot;
+    const char *actualEnd = cashew::parseNumber(src, actual, hasDot);
+    if (actualEnd != expectedEnd || memcmp(&actual, &expected, sizeof(double)) != 0 ||
+        hasDot != (strchr(src, '.') != nullptr)) {
+      printf("mismatch on %s: %.17g instead of %.17g\n", src, actual, expected);
+      abort();
+    }
+  }
+  printf("%d random literals match strtod\n", CHECKS);
+  // then measure the numbers in the input
+  std::string numbers;
+  int count = 0;
+  for (size_t i = 0; i < input.size(); i++) {
+    if ((cashew::Lexer::isDigit(input[i]) || (input[i] == '.' && cashew::Lexer::isDigit(input[i + 1]))) &&
+        (i == 0 || !cashew::isIdentPart(input[i - 1]))) {
+      size_t start = i;
+      while (cashew::isIdentPart(input[i]) || input[i] == '.' ||
+             ((input[i] == '+' || input[i] == '-') && (input[i - 1] == 'e' || input[i - 1] == 'E'))) i++;
+      numbers += input.substr(start, i - start) + ' ';
+      count++;
+    }
+  }
+  printf("%d numbers, %.2f MB\n", count, numbers.size() / (1024. * 1024));
+  measure("parseNumber", numbers, [](const char *src) {
+    double num;
+    bool hasDot;
+    while (*src) src = cashew::parseNumber(src, num, hasDot) + 1;
+  });
+  measure("strtod", numbers, [](const char *src) {
+    char *end;
+    while (*src) {
+      if (src[0] == '0' && (src[1] == 'x' || src[1] == 'X')) strtoull(src, &end, 16);
+      else strtod(src, &end);
+      src = end + 1;
+    }
+  });
+}
+
+// The intern table before IStringTable, for comparison: a node-based unordered_set, with each new
+// string copied into its own allocation
+struct NodeInternTable {
+  struct Entry {
+    mutable const char *str;
+    size_t size;
+    size_t hash;
+  };
+  struct EntryHash {
+    size_t operator()(const Entry& entry) const { return entry.hash; }
+  };
+  struct EntryEqual {
+    bool operator()(const Entry& x, const Entry& y) const {
+      return x.hash == y.hash && x.size == y.size && memcmp(x.str, y.str, x.size) == 0;
+    }
+  };
+  std::unordered_set<Entry, EntryHash, EntryEqual> strings;
+
+  const char *intern(const char *s, size_t size, uint32_t hash) {
+    auto result = strings.insert(Entry{ s, size, hash });
+    if (result.second) {
+      char *copy = (char*)malloc(size+1);
+      memcpy(copy, s, size);
+      copy[size] = 0;
+      result.first->str = copy;
+    }
+    return result.first->str;
+  }
+};
+
+template<class Table>
+static void measureIntern(const char *name, const std::vector<std::string>& names) {
+  std::vector<uint32_t> hashes;
+  for (auto& s : names) hashes.push_back(cashew::IString::hash_c(s.c_str()));
+  size_t before = allocatedBytes();
+  Table *table = new Table(); // leaked, along with its strings
+  double start = now();
+  for (size_t i = 0; i < names.size(); i++) table->intern(names[i].c_str(), names[i].size(), hashes[i]);
+  double inserting = now() - start;
+  size_t memory = allocatedBytes() - before;
+  start = now();
+  for (size_t i = 0; i < names.size(); i++) table->intern(names[i].c_str(), names[i].size(), hashes[i]);
+  double finding = now() - start;
+  printf("%-16s insert %7.2f M/s  find %7.2f M/s  %6.1f bytes per string\n", name,
+         names.size() / inserting / 1e6, names.size() / finding / 1e6, double(memory) / names.size());
+}
+
+static void benchIntern(const std::string& input) {
+  // the distinct identifiers in the input
+  std::vector<std::string> names;
+  std::unordered_set<std::string> seen;
+  for (size_t i = 0; i < input.size(); ) {
+    if (cashew::isIdentInit(input[i]) && (i == 0 || !cashew::isIdentPart(input[i - 1]))) {
+      size_t start = i;
+      while (cashew::isIdentPart(input[i])) i++;
+      std::string name = input.substr(start, i - start);
+      if (seen.insert(name).second) names.push_back(name);
+    } else {
+      i++;
+    }
+  }
+  printf("%d distinct identifiers in the input\n", int(names.size()));
+  measureIntern<NodeInternTable>("unordered_set", names);
+  measureIntern<cashew::IStringTable>("IStringTable", names);
+  // many short local names, as in a large module
+  std::mt19937_64 random(42);
+  names.clear();
+  for (int i = 0; i < 1000000; i++) {
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "$%s%d", random() % 2 ? "i" : "tmp", int(random() % 100000000));
+    names.push_back(buffer);
+  }
+  printf("%d random local names\n", int(names.size()));
+  measureIntern<NodeInternTable>("unordered_set", names);
+  measureIntern<cashew::IStringTable>("IStringTable", names);
+}
+
+// Runs func(thread) on the given number of threads, all starting at once, and returns the time taken
+template<class T>
+static double runThreads(int num, T func) {
+  std::atomic<int> ready(0);
+  std::atomic<bool> go(false);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < num; i++) {
+    threads.emplace_back([&, i]() {
+      ready++;
+      while (!go) std::this_thread::yield();
+      func(i);
+    });
+  }
+  while (ready < num) std::this_thread::yield();
+  double start = now();
+  go = true;
+  for (auto& thread : threads) thread.join();
+  return now() - start;
+}
+
+static void benchThreads(const std::string& input) {
+  int cores = std::max(1, int(std::thread::hardware_concurrency())), maxThreads = std::max(cores, 4);
+  printf("%d cores\n", cores);
+  // stress test: threads intern the same new names, in different orders, and must all get the same
+  // interned strings, with distinct ids
+  const int NAMES = 100000, ROUNDS = 5;
+  for (int round = 0; round < ROUNDS; round++) {
+    std::vector<std::string> names;
+    for (int i = 0; i < NAMES; i++) names.push_back("stress" + std::to_string(round) + "_" + std::to_string(i));
+    std::vector<std::vector<const char*>> results(maxThreads, std::vector<const char*>(NAMES));
+    runThreads(maxThreads, [&](int thread) {
+      std::vector<int> order(NAMES);
+      for (int i = 0; i < NAMES; i++) order[i] = i;
+      std::shuffle(order.begin(), order.end(), std::mt19937(thread));
+      for (int i : order) results[thread][i] = cashew::IString(names[i].c_str()).str;
+    });
+    std::unordered_set<uint32_t> ids;
+    for (int i = 0; i < NAMES; i++) {
+      cashew::IString str;
+      str.str = results[0][i];
+      bool agree = true;
+      for (int thread = 1; thread < maxThreads; thread++) agree = agree && results[thread][i] == str.str;
+      if (!agree || str.size() != names[i].size() || !str.equals(names[i].c_str()) ||
+          cashew::IString::fromId(str.id()) != str || !ids.insert(str.id()).second) {
+        printf("stress test: threads disagree on %s\n", names[i].c_str());
+        abort();
+      }
+    }
+  }
+  printf("stress test: %d threads agree on %d names, %d times\n", maxThreads, NAMES, ROUNDS);
+  // scaling: each thread lexes the input, which is mostly interning strings that other threads are
+  // interning too
+  for (int num = 1; num <= maxThreads; num *= 2) {
+    double time = runThreads(num, [&](int) {
+      cashew::FragStream frags;
+      frags.lex(input.c_str());
+    });
+    printf("lex on %d thread%s %10.3f ms  %10.2f MB/s%s\n", num, num == 1 ? ": " : "s:", time * 1000,
+           num * input.size() / time / (1024 * 1024), num > cores ? "  (more threads than cores)" : "");
+  }
+}
+
+static std::string stringify(Ref ast) {
+  std::ostringstream out;
+  ast->stringify(out);
+  return out.str();
+}
+
+static void benchParallel(const std::string& input) {
+  // ASTs cannot be freed, so this parses just once per thread count, and checks that result
+  int cores = std::max(1, int(std::thread::hardware_concurrency())), maxThreads = std::max(cores, 4);
+  printf("%d cores, %d functions to parse in parallel\n", cores, int(cashew::findFunctions(input.c_str()).size()));
+  cashew::Parser<Ref, ValueBuilder> parser;
+  double start = now();
+  Ref ast = parser.parseToplevel(input.c_str());
+  double time = now() - start;
+  printf("%-32s %10.3f ms  %10.2f MB/s\n", "parse", time * 1000, input.size() / time / (1024 * 1024));
+  std::string expected = stringify(ast);
+  for (int threads = 1; threads <= maxThreads; threads *= 2) {
+    start = now();
+    ast = parser.parseToplevelParallel(input.c_str(), threads);
+    time = now() - start;
+    std::string name = "parse on " + std::to_string(threads) + " thread" + (threads == 1 ? "" : "s");
+    printf("%-32s %10.3f ms  %10.2f MB/s%s\n", name.c_str(), time * 1000, input.size() / time / (1024 * 1024),
+           threads > cores ? "  (more threads than cores)" : "");
+    if (stringify(ast) != expected) {
+      printf("parallel parse on %d threads is different\n", threads);
+      abort();
+    }
+  }
+}
+
+static void benchLazy(const std::string& input) {
+  // as with parallel parsing, each parse is done just once, and the result checked
+  cashew::Parser<Ref, ValueBuilder> parser;
+  double start = now();
+  Ref ast = parser.parseToplevel(input.c_str());
+  double time = now() - start;
+  printf("%-32s %10.3f ms  %10.2f MB/s\n", "parse", time * 1000, input.size() / time / (1024 * 1024));
+  std::string expected = stringify(ast);
+  parser.setLazy(true);
+  start = now();
+  ast = parser.parseToplevel(input.c_str());
+  time = now() - start;
+  printf("%-32s %10.3f ms  %10.2f MB/s  (%d lazy functions)\n", "parse lazily", time * 1000, input.size() / time / (1024 * 1024),
+         int(parser.numLazyFunctions()));
+  if (parser.numLazyFunctions() > 0) {
+    start = now();
+    parser.materialize(parser.numLazyFunctions() / 2);
+    printf("%-32s %10.3f ms\n", "materialize one", (now() - start) * 1000);
+  }
+  start = now();
+  parser.materializeAll();
+  time = now() - start;
+  printf("%-32s %10.3f ms  %10.2f MB/s\n", "materialize all", time * 1000, input.size() / time / (1024 * 1024));
+  if (stringify(ast) != expected) {
+    printf("lazy parse is different\n");
+    abort();
+  }
+}
+
+static void benchStream(const std::string& input) {
+  cashew::Parser<Ref, ValueBuilder> parser;
+  double start = now();
+  Ref ast = parser.parseToplevel(input.c_str());
+  double time = now() - start;
+  printf("%-32s %10.3f ms  %10.2f MB/s\n", "parse", time * 1000, input.size() / time / (1024 * 1024));
+  std::string expected = stringify(ast);
+  for (size_t chunkSize : { 4096, 65536, 1 << 20 }) {
+    cashew::StreamingParser<Ref, ValueBuilder> streaming;
+    size_t maxBuffered = 0;
+    start = now();
+    for (size_t i = 0; i < input.size(); i += chunkSize) {
+      streaming.feed(input.c_str() + i, std::min(chunkSize, input.size() - i));
+      maxBuffered = std::max(maxBuffered, streaming.buffered());
+    }
+    ast = streaming.finish();
+    time = now() - start;
+    std::string name = "stream in " + std::to_string(chunkSize / 1024) + " KB chunks";
+    printf("%-32s %10.3f ms  %10.2f MB/s  (at most %.2f MB buffered)\n", name.c_str(), time * 1000,
+           input.size() / time / (1024 * 1024), maxBuffered / (1024. * 1024));
+    if (stringify(ast) != expected) {
+      printf("streaming parse is different\n");
+      abort();
+    }
+  }
+}
+
+static void benchIncremental(const std::string& input) {
+  // memory is what is allocated while printing, most of which is AST
+  std::ofstream null("/dev/null");
+  size_t before = allocatedBytes();
+  double start = now();
+  {
+    cashew::Parser<Ref, ValueBuilder> parser;
+    Ref ast = parser.parseToplevel(input.c_str());
+    JSPrinter printer(false, false, ast);
+    printer.printAst();
+    null << printer.buffer;
+    printf("%-24s %10.3f ms  %10.2f MB/s  %8.2f MB\n", "parse and print", (now() - start) * 1000,
+           input.size() / (now() - start) / (1024 * 1024), (allocatedBytes() - before) / (1024. * 1024));
+    free(printer.buffer);
+  }
+  before = allocatedBytes();
+  size_t peak = 0;
+  start = now();
+  printIncrementally(input.c_str(), false, false, null, [&](Ref) {
+    peak = std::max(peak, allocatedBytes() - before);
+  });
+  double time = now() - start;
+  printf("%-24s %10.3f ms  %10.2f MB/s  %8.2f MB\n", "print incrementally", time * 1000,
+         input.size() / time / (1024 * 1024), peak / (1024. * 1024));
+}
+
+static void benchBuild(const std::string& input) {
+  // the cost of building the AST: the fastest of a few parses, each into an arena that is reset after
+  // it, outside of the timing, and the memory the first one takes, all of which is AST
+  size_t before = allocatedBytes();
+  Arena::Mark mark = Arena::current().mark();
+  Ref ast = cashew::Parser<Ref, ValueBuilder>().parseToplevel(input.c_str());
+  size_t bytes = allocatedBytes() - before;
+  size_t nodes = 0;
+  traversePre(ast, [&](Ref) { nodes++; });
+  Arena::current().rewind(mark);
+  for (bool hugePages : { false, true }) {
+    Arena arena(hugePages);
+    Arena::Use use(&arena);
+    double fastest = 1e9, fastestReset = 1e9;
+    size_t reserved = 0, used = 0;
+    for (int i = 0; i < 5; i++) {
+      double start = now();
+      cashew::Parser<Ref, ValueBuilder>().parseToplevel(input.c_str());
+      fastest = std::min(fastest, now() - start);
+      reserved = arena.bytesReserved();
+      used = arena.bytesUsed();
+      start = now();
+      arena.reset();
+      fastestReset = std::min(fastestReset, now() - start);
+    }
+    printf("%-24s %10.3f ms  %10.2f MB/s\n", hugePages ? "parse with huge pages" : "parse", fastest * 1000,
+           input.size() / fastest / (1024 * 1024));
+    printf("%-24s %10.3f ms  %8.2f MB reserved, %.2f MB used\n", "reset", fastestReset * 1000,
+           reserved / (1024. * 1024), used / (1024. * 1024));
+    if (!hugePages) {
+      printf("%zu nodes, %.2f M nodes/s, %.1f bytes each\n", nodes, nodes / fastest / 1e6, double(bytes) / nodes);
+    }
+  }
+}
+
+static void benchLocations(const std::string& input) {
+  // parses with and without recording take turns, and the fastest of each is reported. the AST of each
+  // parse is freed, outside of the timing, so that they are alike
+  cashew::SourceLocations locations;
+  double fastest[2] = { 1e9, 1e9 };
+  for (int i = 0; i < 10; i++) {
+    Arena::Mark mark = Arena::current().mark();
+    cashew::Parser<Ref, ValueBuilder> parser;
+    if (i & 1) parser.setLocations(&locations);
+    double start = now();
+    parser.parseToplevel(input.c_str());
+    fastest[i & 1] = std::min(fastest[i & 1], now() - start);
+    Arena::current().rewind(mark);
+  }
+  printf("%-24s %10.3f ms  %10.2f MB/s\n", "parse", fastest[0] * 1000, input.size() / fastest[0] / (1024 * 1024));
+  printf("%-24s %10.3f ms  %10.2f MB/s  (%+.1f%%)\n", "parse with locations", fastest[1] * 1000,
+         input.size() / fastest[1] / (1024 * 1024), (fastest[1] / fastest[0] - 1) * 100);
+  printf("%zu nodes recorded in %.2f MB, %.2f bytes each\n", locations.size(), locations.bytes() / (1024. * 1024),
+         double(locations.bytes()) / locations.size());
+  std::vector<const void*> nodes;
+  locations.forEach([&](const void* node, uint32_t) { nodes.push_back(node); });
+  double start = now();
+  uint32_t offset, line, column;
+  locations.find(nodes[0], offset);
+  locations.getLineColumn(offset, line, column);
+  printf("%-24s %10.3f ms\n", "first lookup", (now() - start) * 1000);
+  start = now();
+  size_t lines = 0;
+  for (const void* node : nodes) {
+    locations.find(node, offset);
+    locations.getLineColumn(offset, line, column);
+    lines += line;
+  }
+  double time = now() - start;
+  printf("%-24s %10.3f ns each\n", "lookups", time / nodes.size() * 1e9);
+  if (lines == 0) abort();
+}
+
+static void benchReparse(const std::string& input) {
+  // add a statement to the end of the function in the middle, and parse the result both ways
+  std::vector<cashew::FunctionSpan> spans = cashew::findFunctions(input.c_str());
+  if (spans.empty()) {
+    printf("no functions to edit\n");
+    return;
+  }
+  uint32_t at = spans[spans.size() / 2].end - 1;
+  std::string statement = "$sum = $sum + 1.0;\n";
+  std::string edited = input.substr(0, at) + statement + input.substr(at);
+  cashew::Parser<Ref, ValueBuilder> parser;
+  double start = now();
+  Ref ast = parser.parseToplevel(edited.c_str());
+  double time = now() - start;
+  printf("%-24s %10.3f ms  %10.2f MB/s\n", "parse", time * 1000, edited.size() / time / (1024 * 1024));
+  std::string expected = stringify(ast);
+  parser.setEditable(true);
+  start = now();
+  ast = parser.parseToplevel(input.c_str());
+  time = now() - start;
+  printf("%-24s %10.3f ms  %10.2f MB/s  (%d functions)\n", "parse editable", time * 1000,
+         input.size() / time / (1024 * 1024), int(spans.size()));
+  start = now();
+  Ref reparsed = parser.reparse(ast, edited.c_str(), edited.size(), at, at, at + statement.size());
+  printf("%-24s %10.3f ms\n", "reparse one function", (now() - start) * 1000);
+  if (reparsed.get() != ast.get() || stringify(ast) != expected) {
+    printf("reparse is different\n");
+    abort();
+  }
+}
+
+static void benchTypes(const std::string& input) {
+  // parses with both builders take turns, as in the locations benchmark
+  double fastest[2] = { 1e9, 1e9 };
+  for (int i = 0; i < 10; i++) {
+    Arena::Mark mark = Arena::current().mark();
+    double start = now();
+    if (i & 1) cashew::Parser<Ref, TypedValueBuilder>().parseToplevel(input.c_str());
+    else cashew::Parser<Ref, ValueBuilder>().parseToplevel(input.c_str());
+    fastest[i & 1] = std::min(fastest[i & 1], now() - start);
+    Arena::current().rewind(mark);
+  }
+  printf("%-24s %10.3f ms  %10.2f MB/s\n", "parse", fastest[0] * 1000, input.size() / fastest[0] / (1024 * 1024));
+  printf("%-24s %10.3f ms  %10.2f MB/s  (%+.1f%%)\n", "parse with types", fastest[1] * 1000,
+         input.size() / fastest[1] / (1024 * 1024), (fastest[1] / fastest[0] - 1) * 100);
+  Ref ast = cashew::Parser<Ref, TypedValueBuilder>().parseToplevel(input.c_str());
+  std::vector<Ref> nodes;
+  traversePre(ast, [&](Ref node) { nodes.push_back(node); });
+  double start = now();
+  size_t typed = 0;
+  for (Ref node : nodes) typed += TypedValueBuilder::getType(node) != ASM_NONE;
+  double time = now() - start;
+  printf("%zu of %zu nodes typed\n", typed, nodes.size());
+  printf("%-24s %10.3f ns each\n", "type queries", time / nodes.size() * 1e9);
+  if (typed == 0) abort();
+}
+
+static void benchCompact(const std::string& input) {
+  // parses with both builders take turns, as in the locations benchmark, each into an arena or compact
+  // AST that is freed outside of the timing. then the last ASTs are traversed and printed
+  double fastest[2] = { 1e9, 1e9 };
+  Arena arena;
+  Arena::Use use(&arena);
+  CompactAst compact;
+  CompactAst::Use useCompact(&compact);
+  Ref ast;
+  CompactRef compactAst;
+  size_t bytes[2] = { 0, 0 };
+  for (int i = 0; i < 10; i++) {
+    double start = now();
+    if (i & 1) {
+      compact.clear();
+      start = now();
+      compactAst = cashew::Parser<CompactRef, CompactBuilder>().parseToplevel(input.c_str());
+      bytes[1] = compact.bytes();
+    } else {
+      arena.reset();
+      start = now();
+      ast = cashew::Parser<Ref, ValueBuilder>().parseToplevel(input.c_str());
+      bytes[0] = arena.bytesUsed();
+    }
+    fastest[i & 1] = std::min(fastest[i & 1], now() - start);
+  }
+  size_t nodes[2] = { 0, 0 };
+  double traversal[2], printing[2];
+  double start = now();
+  traversePre(ast, [&](Ref) { nodes[0]++; });
+  traversal[0] = now() - start;
+  start = now();
+  traversePre(compactAst, [&](CompactRef) { nodes[1]++; });
+  traversal[1] = now() - start;
+  start = now();
+  JSPrinter printer(false, false, ast);
+  printer.printAst();
+  printing[0] = now() - start;
+  start = now();
+  BasicJSPrinter<CompactRef> compactPrinter(false, false, compactAst);
+  compactPrinter.printAst();
+  printing[1] = now() - start;
+  if (nodes[0] != nodes[1] || strcmp(printer.buffer, compactPrinter.buffer) != 0) {
+    printf("compact AST is different\n");
+    abort();
+  }
+  free(printer.buffer);
+  free(compactPrinter.buffer);
+  for (int i = 0; i < 2; i++) {
+    printf("%-24s %10.3f ms  %10.2f MB/s  %8.2f MB, %.1f bytes per node\n", i ? "parse compact" : "parse",
+           fastest[i] * 1000, input.size() / fastest[i] / (1024 * 1024), bytes[i] / (1024. * 1024),
+           double(bytes[i]) / nodes[i]);
+    printf("%-24s %10.3f ms\n", "  traverse", traversal[i] * 1000);
+    printf("%-24s %10.3f ms\n", "  print", printing[i] * 1000);
+  }
+}
+
+static void benchFlat(const std::string& input) {
+  // as the compact benchmark, with a flat AST laid out from each compact one, whose scratch is then
+  // cleared. the traversals count the | nodes, which is all the asm.js int coercions
+  double fastest[2] = { 1e9, 1e9 }, fastestLayout = 1e9;
+  Arena arena;
+  Arena::Use use(&arena);
+  CompactAst compact;
+  CompactAst::Use useCompact(&compact);
+  FlatAst flat;
+  Ref ast;
+  size_t bytes = 0;
+  for (int i = 0; i < 10; i++) {
+    double start = now();
+    if (i & 1) {
+      start = now();
+      CompactRef root = cashew::Parser<CompactRef, CompactBuilder>().parseToplevel(input.c_str());
+      double layout = now();
+      flat.assign(root);
+      compact.clear();
+      fastestLayout = std::min(fastestLayout, now() - layout);
+    } else {
+      arena.reset();
+      start = now();
+      ast = cashew::Parser<Ref, ValueBuilder>().parseToplevel(input.c_str());
+      bytes = arena.bytesUsed();
+    }
+    fastest[i & 1] = std::min(fastest[i & 1], now() - start);
+  }
+  size_t nodes = 0, ors[2] = { 0, 0 };
+  double start = now();
+  traversePre(ast, [&](Ref node) {
+    if (node->getKind() == NK_BINARY && node->getOp() == OP_OR) ors[0]++;
+  });
+  double traversal = now() - start;
+  start = now();
+  const uint8_t *kinds = flat.kinds.data();
+  const uint32_t *payloads = flat.payloads.data();
+  for (size_t i = 0, size = flat.size(); i < size; i++) {
+    if (kinds[i] < NUM_NODE_KINDS) {
+      nodes++;
+      if (kinds[i] == NK_BINARY && payloads[i] == OP_OR) ors[1]++;
+    }
+  }
+  double scan = now() - start;
+  printf("%-24s %10.3f ms  %10.2f MB/s  %8.2f MB\n", "parse", fastest[0] * 1000,
+         input.size() / fastest[0] / (1024 * 1024), bytes / (1024. * 1024));
+  printf("%-24s %10.3f ms  %10.2f MB/s  %8.2f MB  (%.3f ms laying out)\n", "parse flat", fastest[1] * 1000,
+         input.size() / fastest[1] / (1024 * 1024), flat.bytes() / (1024. * 1024), fastestLayout * 1000);
+  printf("%-24s %10.3f ms\n", "traverse", traversal * 1000);
+  printf("%-24s %10.3f ms  (%.1fx faster)\n", "scan flat", scan * 1000, traversal / scan);
+  printf("%zu entries, of which %zu nodes, %zu of them |\n", flat.size(), nodes, ors[1]);
+  if (ors[0] != ors[1] || ors[0] == 0) {
+    printf("flat AST is different\n");
+    abort();
+  }
+}
+
+struct Benchmark {
+  const char *name;
+  void (*run)(const std::string& input);
+};
+
+static Benchmark benchmarks[] = {
+  { "lex", benchLex },
+  { "skipspace", benchSkipSpace },
+  { "numbers", benchNumbers },
+  { "intern", benchIntern },
+  { "threads", benchThreads },
+  { "parallel", benchParallel },
+  { "lazy", benchLazy },
+  { "stream", benchStream },
+  { "incremental", benchIncremental },
+  { "locations", benchLocations },
+  { "build", benchBuild },
+  { "reparse", benchReparse },
+  { "types", benchTypes },
+  { "compact", benchCompact },
+  { "flat", benchFlat },
+};
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    printf("usage: %s BENCHMARK [input.js]\nbenchmarks:", argv[0]);
+    for (auto& benchmark : benchmarks) printf(" %s", benchmark.name);
+    printf("\n");
+    return 1;
+  }
+  std::string input = argc > 2 ? readFile(argv[2]) : generateModule(20000);
+  printf("input: %.2f MB\n", input.size() / (1024. * 1024));
+  for (auto& benchmark : benchmarks) {
+    if (strcmp(argv[1], benchmark.name) == 0) {
+      benchmark.run(input);
+      return 0;
+    }
+  }
+  printf("unknown benchmark: %s\n", argv[1]);
+  return 1;
+}
@@ -1,7 +1,10 @@
 // Interned String type, 100% interned on creation. Comparisons are always just a pointer comparison
 
+#include <atomic>
+#include <mutex>
 #include <unordered_set>
 #include <unordered_map>
+#include <vector>
 
 #include <string.h>
 #include <stdint.h>
@@ -11,15 +14,330 @@
 
 namespace cashew {
 
+// Ids of interned strings. These are shared by the permanent table and all pools (see IStringPool),
+// so they are unique among the strings that exist at any time, and are dense and sequential, starting
+// at 0, except that the ids of strings in a pool that was freed are reused.
+
+class IStringIds {
+  // Strings by id, in chunks that double in size, so that they never move and can be read while
+  // other threads add to them. Chunk k holds FIRST_CHUNK << k ids.
+  static const int FIRST_CHUNK_BITS = 10,
+                   NUM_CHUNKS = 32 - FIRST_CHUNK_BITS;
+  std::atomic<const char**> chunks[NUM_CHUNKS];
+  std::atomic<uint32_t> nextId;
+
+  std::mutex freeMutex;
+  std::vector<uint32_t> freeIds;
+  std::atomic<bool> hasFreeIds;
+
+  static int floorLog2(uint32_t x) {
+    int ret = 0;
+    while (x >>= 1) ret++;
+    return ret;
+  }
+
+  const char *&entry(uint32_t id) {
+    uint32_t biased = id + (1u << FIRST_CHUNK_BITS);
+    int chunk = floorLog2(biased) - FIRST_CHUNK_BITS;
+    const char **entries = chunks[chunk].load(std::memory_order_acquire);
+    if (!entries) {
+      const char **fresh = new const char*[size_t(1) << (chunk + FIRST_CHUNK_BITS)]();
+      if (chunks[chunk].compare_exchange_strong(entries, fresh)) {
+        entries = fresh;
+      } else {
+        delete[] fresh; // another thread got there first
+      }
+    }
+    return entries[biased - (1u << (chunk + FIRST_CHUNK_BITS))];
+  }
+
+  IStringIds() : nextId(0), hasFreeIds(false) {
+    for (auto& chunk : chunks) chunk.store(nullptr, std::memory_order_relaxed);
+  }
+
+public:
+  static IStringIds& get() {
+    static IStringIds* ids = new IStringIds();
+    return *ids;
+  }
+
+  uint32_t allocate(const char *str) {
+    uint32_t id;
+    if (!hasFreeIds.load(std::memory_order_relaxed)) {
+      id = nextId.fetch_add(1, std::memory_order_relaxed);
+    } else {
+      std::lock_guard<std::mutex> lock(freeMutex);
+      if (freeIds.empty()) {
+        id = nextId.fetch_add(1, std::memory_order_relaxed);
+      } else {
+        id = freeIds.back();
+        freeIds.pop_back();
+        hasFreeIds.store(!freeIds.empty(), std::memory_order_relaxed);
+      }
+    }
+    entry(id) = str;
+    return id;
+  }
+
+  void release(uint32_t id) {
+    std::lock_guard<std::mutex> lock(freeMutex);
+    entry(id) = nullptr;
+    freeIds.push_back(id);
+    hasFreeIds.store(true, std::memory_order_relaxed);
+  }
+
+  const char *fromId(uint32_t id) {
+    assert(id < size());
+    return entry(id);
+  }
+
+  // Strings that other threads are interning right now may already have ids below this, but not be
+  // visible from this thread yet.
+  uint32_t size() {
+    return nextId.load(std::memory_order_relaxed);
+  }
+};
+
+// A table of interned strings, which can be used from multiple threads at once.
+//
+// Each string is copied into a slab, preceded by its id and length, so those are always known.
+//
+// The table is split into shards by hash, each an open addressing table with linear probing. Each slot
+// caches the hash and length of its string, so a probe only touches the string itself when it is very
+// likely a match. Finding a string that is already interned takes no lock: a slot is filled in before
+// its string pointer is published, and never changes after that, and when a shard grows its old slots
+// are kept around, so a reader still probing them finds either its string or an empty slot. Only on
+// an empty slot does it lock the shard, and look again before inserting.
+
+class IStringTable {
+  struct Slot {
+    uint32_t hash;
+    uint32_t size;
+    std::atomic<const char*> str; // null if the slot is empty
+  };
+
+  struct Slots {
+    Slot *slots;
+    uint32_t mask; // number of slots, minus one
+    int shift;     // for getting an index from the scrambled hash
+
+    explicit Slots(uint32_t num) : slots(new Slot[num]()), mask(num - 1), shift(32) {
+      while (num > 1) {
+        shift--;
+        num >>= 1;
+      }
+    }
+    ~Slots() {
+      delete[] slots;
+    }
+
+    uint32_t indexFor(uint32_t scrambled) const {
+      return (scrambled << SHARD_BITS) >> shift; // the top bits chose the shard, so use the ones after
+    }
+  };
+
+  struct Shard {
+    std::mutex mutex;
+    std::atomic<Slots*> slots;
+    uint32_t used;
+    std::vector<Slots*> retired; // old slots, which readers may still be looking at
+    char *slab;
+    size_t slabLeft;
+    size_t nextSlabSize; // slabs start small, as there are many shards
+    std::vector<char*> allocations;
+    char padding[64]; // keep shards, which are locked by different threads, in separate cache lines
+  };
+
+  // what precedes each string in its slab
+  struct Header {
+    uint32_t id;
+    uint32_t size;
+  };
+
+  static const int SHARD_BITS = 6,
+                   NUM_SHARDS = 1 << SHARD_BITS;
+  static const uint32_t INITIAL_SLOTS = 64;
+  static const size_t FIRST_SLAB_SIZE = 4 * 1024,
+                      MAX_SLAB_SIZE = 64 * 1024,
+                      MAX_SLAB_STRING = 1024;
+
+  Shard shards[NUM_SHARDS];
+
+  static uint32_t scramble(uint32_t hash) {
+    return hash * 2654435769u; // Fibonacci hashing, as djb2 does not mix its low bits well
+  }
+
+  static const char *find(const Slots& slots, const char *s, size_t size, uint32_t hash, uint32_t& index) {
+    index = slots.indexFor(scramble(hash));
+    while (1) {
+      const Slot& slot = slots.slots[index];
+      const char *str = slot.str.load(std::memory_order_acquire);
+      if (!str) return nullptr;
+      if (slot.hash == hash && slot.size == size && memcmp(str, s, size) == 0) return str;
+      index = (index + 1) & slots.mask;
+    }
+  }
+
+  void grow(Shard& shard) {
+    Slots *old = shard.slots.load(std::memory_order_relaxed);
+    Slots *slots = new Slots((old->mask + 1) * 2);
+    for (uint32_t i = 0; i <= old->mask; i++) {
+      const char *str = old->slots[i].str.load(std::memory_order_relaxed);
+      if (!str) continue;
+      uint32_t index = slots->indexFor(scramble(old->slots[i].hash));
+      while (slots->slots[index].str.load(std::memory_order_relaxed)) index = (index + 1) & slots->mask;
+      slots->slots[index].hash = old->slots[i].hash;
+      slots->slots[index].size = old->slots[i].size;
+      slots->slots[index].str.store(str, std::memory_order_relaxed);
+    }
+    shard.slots.store(slots, std::memory_order_release);
+    shard.retired.push_back(old);
+  }
+
+  const char *store(Shard& shard, const char *s, size_t size) {
+    size_t needed = (sizeof(Header) + size + 1 + 3) & ~size_t(3); // keep the headers aligned
+    char *where;
+    if (needed > MAX_SLAB_STRING) {
+      where = (char*)malloc(needed); // too big to share a slab
+      shard.allocations.push_back(where);
+    } else {
+      if (needed > shard.slabLeft) {
+        // the rest of the old slab is wasted, which is at most a quarter of it
+        shard.slab = (char*)malloc(shard.nextSlabSize);
+        shard.slabLeft = shard.nextSlabSize;
+        shard.allocations.push_back(shard.slab);
+        if (shard.nextSlabSize < MAX_SLAB_SIZE) shard.nextSlabSize *= 2;
+      }
+      where = shard.slab;
+      shard.slab += needed;
+      shard.slabLeft -= needed;
+    }
+    assert(where);
+    Header *header = (Header*)where;
+    char *ret = where + sizeof(Header);
+    memcpy(ret, s, size);
+    ret[size] = 0;
+    header->id = IStringIds::get().allocate(ret);
+    header->size = uint32_t(size);
+    return ret;
+  }
+
+public:
+  IStringTable() {
+    for (auto& shard : shards) {
+      shard.slots.store(new Slots(INITIAL_SLOTS), std::memory_order_relaxed);
+      shard.used = 0;
+      shard.slab = nullptr;
+      shard.slabLeft = 0;
+      shard.nextSlabSize = FIRST_SLAB_SIZE;
+    }
+  }
+
+  // Frees all the strings, and their ids. Nothing may use them any more.
+  ~IStringTable() {
+    for (auto& shard : shards) {
+      Slots *slots = shard.slots.load(std::memory_order_relaxed);
+      for (uint32_t i = 0; i <= slots->mask; i++) {
+        const char *str = slots->slots[i].str.load(std::memory_order_relaxed);
+        if (str) IStringIds::get().release(idOf(str));
+      }
+      delete slots;
+      for (auto* slots : shard.retired) delete slots;
+      for (auto* allocation : shard.allocations) free(allocation);
+    }
+  }
+
+  // Returns the interned copy of the size characters at s, which have the given hash, or nullptr if
+  // they are not in the table. This takes no lock.
+  const char *find(const char *s, size_t size, uint32_t hash) {
+    Shard& shard = shards[scramble(hash) >> (32 - SHARD_BITS)];
+    uint32_t index;
+    return find(*shard.slots.load(std::memory_order_acquire), s, size, hash, index);
+  }
+
+  // Returns the interned copy of the size characters at s, which have the given hash, adding them if
+  // they are not in the table yet
+  const char *intern(const char *s, size_t size, uint32_t hash) {
+    Shard& shard = shards[scramble(hash) >> (32 - SHARD_BITS)];
+    uint32_t index;
+    const char *ret = find(*shard.slots.load(std::memory_order_acquire), s, size, hash, index);
+    if (ret) return ret; // the common case, which needs no lock
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    Slots& slots = *shard.slots.load(std::memory_order_relaxed);
+    ret = find(slots, s, size, hash, index); // another thread may have added it, or grown the shard
+    if (ret) return ret;
+    ret = store(shard, s, size);
+    Slot& slot = slots.slots[index];
+    slot.hash = hash;
+    slot.size = uint32_t(size);
+    slot.str.store(ret, std::memory_order_release);
+    if (++shard.used * 2 > slots.mask + 1) grow(shard); // stay at most half full, so probe sequences are short
+    return ret;
+  }
+
+  static size_t sizeOf(const char *str) {
+    return ((const Header*)str - 1)->size;
+  }
+
+  static uint32_t idOf(const char *str) {
+    return ((const Header*)str - 1)->id;
+  }
+
+};
+
+// A pool of interned strings that are freed all at once, for example after compiling a module. While a
+// thread uses a pool, strings it interns that are not in the permanent table already are added to the
+// pool instead, and stay there even if the permanent table gets them later. Those are only equal to
+// the same strings interned while using the same pool, and neither they nor their ids may be used after
+// the pool is destroyed (ids are reused then).
+//
+// The permanent table holds the strings interned while no pool is used, including all those created
+// during static initialization, like the common strings of the parser.
+
+class IStringPool {
+  IStringTable table;
+
+  static IStringPool *&currentRef() {
+    static thread_local IStringPool *pool = nullptr;
+    return pool;
+  }
+
+  friend struct IString;
+
+public:
+  // The pool this thread uses, or nullptr
+  static IStringPool *current() {
+    return currentRef();
+  }
+
+  // Uses a pool on this thread for as long as this exists. Several threads can use the same pool.
+  class Use {
+    IStringPool *previous;
+  public:
+    explicit Use(IStringPool& pool) : previous(current()) {
+      currentRef() = &pool;
+    }
+    explicit Use(IStringPool *pool) : previous(current()) { // nullptr for the permanent table
+      currentRef() = pool;
+    }
+    ~Use() {
+      currentRef() = previous;
+    }
+  };
+};
+
 struct IString {
   const char *str;
 
-  static size_t hash_c(const char *str) { // see http://www.cse.yorku.ca/~oz/hash.html
-    unsigned int hash = 5381;
-    int c;
-    while ((c = *str++)) {
-      hash = ((hash << 5) + hash) ^ c;
-    }
+  // The hash can be computed a character at a time, as the lexer scans, using hashInit and hashChar
+  static const uint32_t hashInit = 5381;
+  static uint32_t hashChar(uint32_t hash, char c) { // see http://www.cse.yorku.ca/~oz/hash.html
+    return ((hash << 5) + hash) ^ (unsigned char)c;
+  }
+
+  static size_t hash_c(const char *str) {
+    uint32_t hash = hashInit;
+    while (*str) hash = hashChar(hash, *str++);
     return (size_t)hash;
   }
 
@@ -37,31 +355,55 @@ struct IString {
   };
 
   IString() : str(nullptr) {}
-  IString(const char *s, bool reuse=true) { // if reuse=true, then input is assumed to remain alive; not copied
+  IString(const char *s, bool reuse=true) {
     set(s, reuse);
   }
 
-  void set(const char *s, bool reuse=true) {
-    typedef std::unordered_set<const char *, CStringHash, CStringEqual> StringSet;
-    static StringSet* strings = new StringSet();
+  // Interned strings are always copied, so that their length is stored with them. reuse is ignored,
+  // and only kept for compatibility.
+  void set(const char *s, bool /* reuse */=true) {
+    set(s, strlen(s), hash_c(s));
+  }
 
-    if (reuse) {
-      auto result = strings->insert(s); // if already present, does nothing
-      str = *(result.first);
+  // Interns size characters at s, which do not need to be null-terminated, given their hash
+  void set(const char *s, size_t size, uint32_t hash) {
+    IStringPool *pool = IStringPool::current();
+    if (!pool) {
+      str = table().intern(s, size, hash);
     } else {
-      auto existing = strings->find(s);
-      if (existing == strings->end()) {
-        char *copy = (char*)malloc(strlen(s)+1); // XXX leaked
-        strcpy(copy, s);
-        s = copy;
-      } else {
-        s = *existing;
-      }
-      strings->insert(s);
-      str = s;
+      // the pool first, as a string may have been added to the permanent table after the pool got it
+      str = pool->table.find(s, size, hash);
+      if (!str) str = table().find(s, size, hash);
+      if (!str) str = pool->table.intern(s, size, hash);
     }
   }
 
+  // The length of the string, without needing to scan it
+  size_t size() const {
+    return str ? IStringTable::sizeOf(str) : 0;
+  }
+
+  // Every interned string has a dense id, so side tables can be arrays indexed by it (see IStringMap
+  // and IStringBitSet). Ids are below numIds().
+  uint32_t id() const {
+    assert(str);
+    return IStringTable::idOf(str);
+  }
+  static IString fromId(uint32_t id) {
+    IString ret;
+    ret.str = IStringIds::get().fromId(id);
+    return ret;
+  }
+  static uint32_t numIds() {
+    return IStringIds::get().size();
+  }
+
+  // The permanent table
+  static IStringTable& table() {
+    static IStringTable* table = new IStringTable();
+    return *table;
+  }
+
   void set(const IString &s) {
     str = s.str;
   }
@@ -120,16 +462,17 @@ namespace cashew {
 class IStringSet : public std::unordered_set<IString> {
 public:
   IStringSet() {}
-  IStringSet(const char *init) { // comma-delimited list
-    int size = strlen(init);
-    char *curr = new char[size+1]; // leaked!
-    strcpy(curr, init);
+  IStringSet(const char *init) { // space-delimited list
     while (1) {
-      char *end = strchr(curr, ' ');
-      if (end) *end = 0;
-      insert(curr);
-      if (!end) break;
-      curr = end + 1;
+      const char *end = strchr(init, ' ');
+      if (!end) end = init + strlen(init);
+      uint32_t hash = IString::hashInit;
+      for (const char *curr = init; curr < end; curr++) hash = IString::hashChar(hash, *curr);
+      IString str;
+      str.set(init, end - init, hash);
+      insert(str);
+      if (!*end) break;
+      init = end + 1;
     }
   }
 
@@ -138,5 +481,87 @@ public:
   }
 };
 
+// IStringBitSet: a set of interned strings, as bits indexed by their ids. Much faster than IStringSet,
+// but takes space for every string interned so far, so it is best for sets that are large or live long.
+
+class IStringBitSet {
+  std::vector<uint64_t> bits;
+
+public:
+  void insert(IString str) {
+    uint32_t id = str.id();
+    if (id / 64 >= bits.size()) bits.resize(IString::numIds() / 64 + 1);
+    bits[id / 64] |= uint64_t(1) << (id % 64);
+  }
+
+  void erase(IString str) {
+    uint32_t id = str.id();
+    if (id / 64 < bits.size()) bits[id / 64] &= ~(uint64_t(1) << (id % 64));
+  }
+
+  bool has(IString str) const {
+    uint32_t id = str.id();
+    return id / 64 < bits.size() && (bits[id / 64] & (uint64_t(1) << (id % 64)));
+  }
+
+  void clear() {
+    bits.clear();
+  }
+
+  template<class F>
+  void forEach(F func) const { // in id order
+    for (size_t i = 0; i < bits.size(); i++) {
+      uint64_t word = bits[i];
+      for (uint32_t j = 0; word; j++, word >>= 1) {
+        if (word & 1) func(IString::fromId(uint32_t(i * 64 + j)));
+      }
+    }
+  }
+};
+
+// IStringMap: a map from interned strings to T, as an array indexed by their ids. Like IStringBitSet,
+// this takes space for every string interned so far.
+
+template<class T>
+class IStringMap {
+  std::vector<T> values;
+  IStringBitSet present;
+
+public:
+  T& operator[](IString str) {
+    uint32_t id = str.id();
+    if (id >= values.size()) values.resize(IString::numIds());
+    present.insert(str);
+    return values[id];
+  }
+
+  // Returns a pointer to the value, or nullptr if there is none
+  T* find(IString str) {
+    return has(str) ? &values[str.id()] : nullptr;
+  }
+
+  bool has(IString str) const {
+    return present.has(str);
+  }
+
+  void erase(IString str) {
+    if (!has(str)) return;
+    values[str.id()] = T();
+    present.erase(str);
+  }
+
+  void clear() {
+    values.clear();
+    present.clear();
+  }
+
+  template<class F>
+  void forEach(F func) { // in id order
+    present.forEach([&](IString str) {
+      func(str, values[str.id()]);
+    });
+  }
+};
+
 } // namespace cashew
 
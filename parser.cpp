@@ -1,6 +1,29 @@
 
 #include "parser.h"
 
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// The vectorized whitespace skippers read whole aligned chunks, so they can read past the 0 terminator.
+// An aligned chunk never crosses into another page, so this cannot fault, but it is out of bounds all
+// the same, which AddressSanitizer reports, so builds with it use the scalar skipper only.
+#if defined(__SANITIZE_ADDRESS__)
+#define CASHEW_SANITIZE_ADDRESS
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define CASHEW_SANITIZE_ADDRESS
+#endif
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && !defined(CASHEW_SANITIZE_ADDRESS)
+#define CASHEW_X86_SIMD
+#include <immintrin.h>
+#endif
+
 namespace cashew {
 
 // common strings
@@ -73,6 +96,9 @@ IString TOPLEVEL("toplevel"),
         OPEN_BRACE("["),
         OPEN_CURLY("{"),
         CLOSE_CURLY("}"),
+        CLOSE_PAREN(")"),
+        CLOSE_BRACE("]"),
+        SEMICOLON(";"),
         COMMA(","),
         QUESTION("?"),
         COLON(":"),
@@ -86,16 +112,102 @@ IString TOPLEVEL("toplevel"),
         THROW("throw"),
         SET("=");
 
-IStringSet keywords("var const function if else do while for break continue return switch case default throw try catch finally true false null new");
+#define CASHEW_KEYWORDS "var const function if else do while for break continue return switch case default throw try catch finally true false null new"
+#define CASHEW_OPERATOR_INITS "+-*/%<>&^|~=!,?:."
+#define CASHEW_SEPARATORS "([;{})]"
+
+IStringSet keywords(CASHEW_KEYWORDS);
+
+const char *OPERATOR_INITS = CASHEW_OPERATOR_INITS,
+           *SEPARATORS = CASHEW_SEPARATORS;
+
+// character classes
+
+static constexpr bool constHasChar(const char* list, int x) {
+  return *list && (*list == x || constHasChar(list + 1, x));
+}
+
+static constexpr unsigned char charClass(int x) {
+  return (x == ' ' || x == '\t' || x == '\n' || x == '\r' ? CHAR_SPACE : 0) |
+         ((x >= 'a' && x <= 'z') || (x >= 'A' && x <= 'Z') || x == '_' || x == '$' ? CHAR_IDENT_INIT | CHAR_IDENT_PART : 0) |
+         (x >= '0' && x <= '9' ? CHAR_IDENT_PART : 0) |
+         (x && constHasChar(CASHEW_OPERATOR_INITS, x) ? CHAR_OPERATOR_INIT : 0) |
+         (x && constHasChar(CASHEW_SEPARATORS, x) ? CHAR_SEPARATOR : 0);
+}
+
+#define CHAR_CLASSES_4(x) charClass(x), charClass(x + 1), charClass(x + 2), charClass(x + 3)
+#define CHAR_CLASSES_16(x) CHAR_CLASSES_4(x), CHAR_CLASSES_4(x + 4), CHAR_CLASSES_4(x + 8), CHAR_CLASSES_4(x + 12)
+#define CHAR_CLASSES_64(x) CHAR_CLASSES_16(x), CHAR_CLASSES_16(x + 16), CHAR_CLASSES_16(x + 32), CHAR_CLASSES_16(x + 48)
+
+constexpr unsigned char charClasses[256] = {
+  CHAR_CLASSES_64(0), CHAR_CLASSES_64(64), CHAR_CLASSES_64(128), CHAR_CLASSES_64(192)
+};
+
+// keywords. Each has a distinct hash of its first two characters and its length, so a table of
+// 64 slots finds the only keyword a string could be.
+
+static constexpr const char* keywordList[] = {
+  "var", "const", "function", "if", "else", "do", "while", "for", "break", "continue", "return",
+  "switch", "case", "default", "throw", "try", "catch", "finally", "true", "false", "null", "new"
+};
+
+static const int NUM_KEYWORDS = sizeof(keywordList) / sizeof(keywordList[0]),
+                 KEYWORD_SLOTS = 64;
+
+static constexpr int constStrlen(const char* str) {
+  return *str ? 1 + constStrlen(str + 1) : 0;
+}
+
+static constexpr int keywordHash(const char* str, int size) {
+  return ((unsigned char)str[0] + (unsigned char)str[1] + 23 * size) & (KEYWORD_SLOTS - 1);
+}
 
-const char *OPERATOR_INITS = "+-*/%<>&^|~=!,?:.",
-           *SEPARATORS = "([;{}";
+// the index in keywordList of the keyword that hashes to slot, starting the search at i, or -1
+static constexpr int keywordInSlot(int slot, int i) {
+  return i == NUM_KEYWORDS ? -1 :
+         keywordHash(keywordList[i], constStrlen(keywordList[i])) == slot ? i :
+         keywordInSlot(slot, i + 1);
+}
+
+static constexpr bool keywordHashIsPerfect(int slot) {
+  return slot == KEYWORD_SLOTS ||
+         ((keywordInSlot(slot, 0) < 0 || keywordInSlot(slot, keywordInSlot(slot, 0) + 1) < 0) &&
+          keywordHashIsPerfect(slot + 1));
+}
 
-int MAX_OPERATOR_SIZE = 3;
+static_assert(keywordHashIsPerfect(0), "every keyword must hash to a different slot");
+
+#define KEYWORD_SLOTS_4(x) keywordInSlot(x, 0), keywordInSlot(x + 1, 0), keywordInSlot(x + 2, 0), keywordInSlot(x + 3, 0)
+#define KEYWORD_SLOTS_16(x) KEYWORD_SLOTS_4(x), KEYWORD_SLOTS_4(x + 4), KEYWORD_SLOTS_4(x + 8), KEYWORD_SLOTS_4(x + 12)
+
+static constexpr signed char keywordSlots[KEYWORD_SLOTS] = {
+  KEYWORD_SLOTS_16(0), KEYWORD_SLOTS_16(16), KEYWORD_SLOTS_16(32), KEYWORD_SLOTS_16(48)
+};
+
+static IString keywordStrings[NUM_KEYWORDS];
+
+IString findKeyword(const char* str, int size) {
+  if (size < 2) return IString();
+  int keyword = keywordSlots[keywordHash(str, size)];
+  if (keyword < 0) return IString();
+  const char* candidate = keywordList[keyword];
+  if (strncmp(candidate, str, size) != 0 || candidate[size] != 0) return IString();
+  return keywordStrings[keyword];
+}
+
+int MAX_OPERATOR_SIZE = 3,
+    LOWEST_PREC;
 
 std::vector<OperatorClass> operatorClasses;
 
-static std::vector<std::unordered_map<IString, int>> precedences; // op, type => prec
+// Operators are identified by their first character, plus whether it is followed by nothing, by a '='
+// (as in <= or !=), or by anything else (a repeat, as in << or >>>). That is enough to tell apart all
+// the operators within a type, and makes precedence lookups constant-time.
+static int operatorKey(IString op) {
+  return (unsigned char)op[0] | ((op[1] == 0 ? 0 : (op[1] == '=' ? 1 : 2)) << 8);
+}
+
+static int precedences[OperatorClass::Tertiary + 1][3 << 8]; // type, op key => prec, or -1
 
 struct Init {
   Init() {
@@ -114,11 +226,22 @@ struct Init {
     operatorClasses.push_back(OperatorClass("=",         true,  OperatorClass::Binary));
     operatorClasses.push_back(OperatorClass(",",         true,  OperatorClass::Binary));
 
-    precedences.resize(OperatorClass::Tertiary + 1);
+    LOWEST_PREC = operatorClasses.size() - 1;
+
+    for (int i = 0; i < NUM_KEYWORDS; i++) {
+      keywordStrings[i] = IString(keywordList[i]);
+      assert(keywords.has(keywordStrings[i]));
+    }
+    assert(keywords.size() == size_t(NUM_KEYWORDS));
+
+    useSkipSpaceImplementation("avx2") || useSkipSpaceImplementation("sse2") || useSkipSpaceImplementation("scalar");
 
+    for (auto& byType : precedences) {
+      for (auto& prec : byType) prec = -1;
+    }
     for (size_t prec = 0; prec < operatorClasses.size(); prec++) {
       for (auto curr : operatorClasses[prec].ops) {
-        precedences[operatorClasses[prec].type][curr] = prec;
+        precedences[operatorClasses[prec].type][operatorKey(curr)] = prec;
       }
     }
   }
@@ -127,15 +250,678 @@ struct Init {
 Init init;
 
 int OperatorClass::getPrecedence(Type type, IString op) {
-  return precedences[type][op];
+  return precedences[type][operatorKey(op)];
 }
 
 bool OperatorClass::getRtl(int prec) {
   return operatorClasses[prec].rtl;
 }
 
-bool isIdentInit(char x) { return (x >= 'a' && x <= 'z') || (x >= 'A' && x <= 'Z') || x == '_' || x == '$'; }
-bool isIdentPart(char x) { return isIdentInit(x) || (x >= '0' && x <= '9'); }
+// Whitespace and comment skipping. The vectorized implementations classify 16 or 32 bytes at a time,
+// using aligned loads: those never cross a page boundary, so it is safe to read past the terminating 0
+// as long as it is in the same aligned block.
+
+static bool isSpace(char x) { return x == 32 || x == 9 || x == 10 || x == 13; }
+
+static const char* skipSpaceScalar(const char* curr) {
+  while (1) {
+    while (isSpace(*curr)) curr++;
+    if (curr[0] != '/') return curr;
+    if (curr[1] == '/') {
+      curr += 2;
+      while (*curr && *curr != '\n') curr++;
+      if (*curr) curr++;
+    } else if (curr[1] == '*') {
+      curr += 2;
+      while (*curr && (curr[0] != '*' || curr[1] != '/')) curr++;
+      if (!*curr) return curr; // unterminated comment
+      curr += 2;
+    } else {
+      return curr;
+    }
+  }
+}
+
+#ifdef CASHEW_X86_SIMD
+
+// The searches below load aligned chunks, from the one that curr is in up to the one with what they
+// look for, which is at the latest the one with the 0 terminator. So the bytes they read that are
+// outside the string are before it or after its end in the same chunk, and an aligned chunk is never
+// split between two pages: if any of it is mapped, all of it is.
+
+// Bits are set for the bytes that are not whitespace. The 0 terminator is not whitespace either, so
+// searching for one of these bits always ends there at the latest.
+__attribute__((target("sse2")))
+static unsigned nonSpaceMaskSSE2(__m128i chunk) {
+  __m128i space = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8(' ')),
+                                            _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\t'))),
+                               _mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('\n')),
+                                            _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\r'))));
+  return ~_mm_movemask_epi8(space) & 0xffff;
+}
+
+// Bits are set for the bytes that are x, or the 0 terminator
+__attribute__((target("sse2")))
+static unsigned byteOrEndMaskSSE2(__m128i chunk, char x) {
+  return _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8(x)),
+                                        _mm_cmpeq_epi8(chunk, _mm_setzero_si128())));
+}
+
+__attribute__((target("sse2")))
+static const char* findNonSpaceSSE2(const char* curr) {
+  uintptr_t misalignment = uintptr_t(curr) & 15;
+  const __m128i* chunk = (const __m128i*)(curr - misalignment);
+  unsigned mask = nonSpaceMaskSSE2(_mm_load_si128(chunk)) & (0xffffu << misalignment);
+  while (!mask) mask = nonSpaceMaskSSE2(_mm_load_si128(++chunk));
+  return (const char*)chunk + __builtin_ctz(mask);
+}
+
+__attribute__((target("sse2")))
+static const char* findByteOrEndSSE2(const char* curr, char x) {
+  uintptr_t misalignment = uintptr_t(curr) & 15;
+  const __m128i* chunk = (const __m128i*)(curr - misalignment);
+  unsigned mask = byteOrEndMaskSSE2(_mm_load_si128(chunk), x) & (0xffffu << misalignment);
+  while (!mask) mask = byteOrEndMaskSSE2(_mm_load_si128(++chunk), x);
+  return (const char*)chunk + __builtin_ctz(mask);
+}
+
+__attribute__((target("avx2")))
+static unsigned nonSpaceMaskAVX2(__m256i chunk) {
+  __m256i space = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, _mm256_set1_epi8(' ')),
+                                                  _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('\t'))),
+                                  _mm256_or_si256(_mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('\n')),
+                                                  _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('\r'))));
+  return ~unsigned(_mm256_movemask_epi8(space));
+}
+
+__attribute__((target("avx2")))
+static unsigned byteOrEndMaskAVX2(__m256i chunk, char x) {
+  return _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, _mm256_set1_epi8(x)),
+                                              _mm256_cmpeq_epi8(chunk, _mm256_setzero_si256())));
+}
+
+__attribute__((target("avx2")))
+static const char* findNonSpaceAVX2(const char* curr) {
+  uintptr_t misalignment = uintptr_t(curr) & 31;
+  const __m256i* chunk = (const __m256i*)(curr - misalignment);
+  unsigned mask = nonSpaceMaskAVX2(_mm256_load_si256(chunk)) & (0xffffffffu << misalignment);
+  while (!mask) mask = nonSpaceMaskAVX2(_mm256_load_si256(++chunk));
+  return (const char*)chunk + __builtin_ctz(mask);
+}
+
+__attribute__((target("avx2")))
+static const char* findByteOrEndAVX2(const char* curr, char x) {
+  uintptr_t misalignment = uintptr_t(curr) & 31;
+  const __m256i* chunk = (const __m256i*)(curr - misalignment);
+  unsigned mask = byteOrEndMaskAVX2(_mm256_load_si256(chunk), x) & (0xffffffffu << misalignment);
+  while (!mask) mask = byteOrEndMaskAVX2(_mm256_load_si256(++chunk), x);
+  return (const char*)chunk + __builtin_ctz(mask);
+}
+
+// The same as skipSpaceScalar, using the given primitives. Most runs of whitespace between tokens are
+// a few bytes, so those are skipped a byte at a time before using vectors.
+#define SKIP_SPACE_VECTORIZED(findNonSpace, findByteOrEnd) \
+  while (1) { \
+    if (isSpace(*curr) && isSpace(*++curr) && isSpace(*++curr) && isSpace(*++curr)) curr = findNonSpace(curr + 1); \
+    if (curr[0] != '/') return curr; \
+    if (curr[1] == '/') { \
+      curr = findByteOrEnd(curr + 2, '\n'); \
+      if (*curr) curr++; \
+    } else if (curr[1] == '*') { \
+      curr += 2; \
+      while (1) { \
+        curr = findByteOrEnd(curr, '*'); \
+        if (!*curr) return curr; /* unterminated comment */ \
+        if (curr[1] == '/') break; \
+        curr++; \
+      } \
+      curr += 2; \
+    } else { \
+      return curr; \
+    } \
+  }
+
+__attribute__((target("sse2")))
+static const char* skipSpaceSSE2(const char* curr) {
+  SKIP_SPACE_VECTORIZED(findNonSpaceSSE2, findByteOrEndSSE2)
+}
+
+__attribute__((target("avx2")))
+static const char* skipSpaceAVX2(const char* curr) {
+  SKIP_SPACE_VECTORIZED(findNonSpaceAVX2, findByteOrEndAVX2)
+}
+
+#endif // CASHEW_X86_SIMD
+
+static const char* (*skipSpaceImplementation)(const char*) = nullptr;
+
+bool useSkipSpaceImplementation(const char* name) {
+  if (strcmp(name, "scalar") == 0) {
+    skipSpaceImplementation = skipSpaceScalar;
+    return true;
+  }
+#ifdef CASHEW_X86_SIMD
+  __builtin_cpu_init(); // we may run before the constructors that would do this
+  if (strcmp(name, "sse2") == 0 && __builtin_cpu_supports("sse2")) {
+    skipSpaceImplementation = skipSpaceSSE2;
+    return true;
+  }
+  if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+    skipSpaceImplementation = skipSpaceAVX2;
+    return true;
+  }
+#endif
+  return false;
+}
+
+const char* skipSpaceAndComments(const char* curr) {
+  return skipSpaceImplementation(curr);
+}
+
+void Lexer::fail(const char* at, const char* expected, ParseError::Code code) {
+  Failure failure;
+  failure.code = *at ? code : ParseError::UNEXPECTED_END;
+  failure.at = at;
+  failure.expected = expected;
+  throw failure;
+}
+
+void FragStream::lex(const char* src) {
+  types.clear();
+  payloads.clear();
+  sizes.clear();
+  offsets.clear();
+  const char *start = src;
+  while (1) {
+    src = Lexer::skipSpace(src);
+    offsets.push_back(src - start);
+    if (!*src) break;
+    Lexer::Frag frag;
+    try {
+      frag = Lexer::Frag(src);
+    } catch (Lexer::Failure&) {
+      break; // the parser will fail here, and report it
+    }
+    types.push_back(frag.type);
+    Payload payload;
+    if (frag.isNumber()) payload.num = frag.num;
+    else payload.str = frag.str.str;
+    payloads.push_back(payload);
+    sizes.push_back(frag.size);
+    src += frag.size;
+  }
+}
+
+// Scanning for functions, which only needs to follow strings, comments and braces, and to notice the
+// function keyword
+
+// If curr is at a string or comment, returns where it ends, or nullptr for an unterminated string.
+// Otherwise returns curr.
+static const char* skipStringOrComment(const char* curr) {
+  if (*curr == '"' || *curr == '\'') {
+    const char* end = strchr(curr + 1, *curr);
+    return end ? end + 1 : nullptr;
+  }
+  if (curr[0] == '/' && (curr[1] == '/' || curr[1] == '*')) return skipSpaceAndComments(curr);
+  return curr;
+}
+
+static bool isFunctionKeyword(const char* start, const char* end) {
+  return end - start == 8 && strncmp(start, "function", 8) == 0;
+}
+
+std::vector<FunctionSpan> findFunctions(const char* src) {
+  struct Function {
+    FunctionSpan span;
+    int level; // how many functions this is inside
+    int parent; // index in all, or -1
+    bool hasChildren;
+  };
+  std::vector<Function> all;
+  std::vector<int> open; // for each open curly brace, the index of the function it is the body of, or -1
+  std::vector<int> functions; // the functions we are inside
+  int pending = -1; // a function whose body is the next curly brace
+  const char* curr = src;
+  while (*curr) {
+    const char* next = skipStringOrComment(curr);
+    if (!next) break;
+    if (next != curr) {
+      curr = next;
+      continue;
+    }
+    char c = *curr;
+    if (isIdentPart(c)) {
+      const char* start = curr;
+      while (isIdentPart(*curr)) curr++;
+      if (isFunctionKeyword(start, curr)) {
+        Function function;
+        function.span.start = skipSpaceAndComments(curr) - src;
+        function.span.end = 0;
+        function.level = functions.size();
+        function.parent = functions.empty() ? -1 : functions.back();
+        function.hasChildren = false;
+        if (function.parent >= 0) all[function.parent].hasChildren = true;
+        pending = all.size();
+        all.push_back(function);
+      }
+    } else if (c == '{') {
+      open.push_back(pending);
+      if (pending >= 0) functions.push_back(pending);
+      pending = -1;
+      curr++;
+    } else if (c == '}') {
+      if (open.empty()) break;
+      if (open.back() >= 0) {
+        all[open.back()].span.end = curr + 1 - src;
+        functions.pop_back();
+      }
+      open.pop_back();
+      curr++;
+    } else {
+      curr++;
+    }
+  }
+  std::vector<FunctionSpan> ret;
+  for (auto& function : all) {
+    if (function.span.end == 0) continue; // unfinished
+    if ((function.level == 0 && !function.hasChildren) ||
+        (function.level == 1 && all[function.parent].span.end != 0)) {
+      ret.push_back(function.span);
+    }
+  }
+  return ret;
+}
+
+// Skips a function body, and if not nested, stops at the first function inside it
+static const char* skipBody(const char* src, bool nested) {
+  assert(*src == '{');
+  int depth = 0;
+  const char* curr = src;
+  while (*curr) {
+    const char* next = skipStringOrComment(curr);
+    if (!next) return nullptr;
+    if (next != curr) {
+      curr = next;
+      continue;
+    }
+    char c = *curr;
+    if (isIdentPart(c)) {
+      const char* start = curr;
+      while (isIdentPart(*curr)) curr++;
+      if (!nested && isFunctionKeyword(start, curr)) return nullptr;
+      continue;
+    }
+    if (c == '{') {
+      depth++;
+    } else if (c == '}') {
+      if (--depth == 0) return curr + 1;
+    }
+    curr++;
+  }
+  return nullptr;
+}
+
+const char* skipFunctionBody(const char* src) {
+  return skipBody(src, false);
+}
+
+const char* skipFunction(const char* src) {
+  const char* curr = src;
+  while (*curr != '{') {
+    const char* next = skipStringOrComment(curr);
+    if (!next) return nullptr;
+    if (next != curr) {
+      curr = next;
+      continue;
+    }
+    char c = *curr;
+    if (isIdentPart(c)) {
+      const char* start = curr;
+      while (isIdentPart(*curr)) curr++;
+      if (isFunctionKeyword(start, curr)) return nullptr;
+      continue;
+    }
+    if (!isSpace(c) && c != '(' && c != ')' && c != ',') return nullptr;
+    curr++;
+  }
+  return skipBody(curr, true);
+}
+
+// Numeric literals. Hex integers and decimals whose digits fit in 64 bits and whose power of ten is
+// small are converted exactly here (Clinger's fast path: both the mantissa and the power of ten are
+// exact doubles, so a single multiplication or division rounds correctly); the rest use strtod.
+
+static const double exactPowersOfTen[] = {
+  1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static const int MAX_EXACT_POWER_OF_TEN = 22;
+static const uint64_t MAX_EXACT_MANTISSA = uint64_t(1) << 53;
+
+const char* parseNumber(const char* src, double& num, bool& hasDot) {
+  const char *start = src;
+  hasDot = false;
+  if (src[0] == '0' && (src[1] == 'x' || src[1] == 'X')) {
+    // Explicitly parse hex numbers of form "0x...", because strtod
+    // supports hex number strings only in C++11, and Visual Studio 2013 does
+    // not yet support that functionality.
+    src += 2;
+    uint64_t value = 0;
+    int extraDigits = 0;
+    while (1) {
+      int digit;
+      if (*src >= '0' && *src <= '9') digit = *src - '0';
+      else if (*src >= 'a' && *src <= 'f') digit = *src - 'a' + 10;
+      else if (*src >= 'A' && *src <= 'F') digit = *src - 'A' + 10;
+      else break;
+      if ((value >> 60) == 0) {
+        value = value * 16 + digit;
+      } else {
+        // no room for more digits. those are far below where the double will be rounded, so all that
+        // matters about them is whether they are 0
+        if (digit) value |= 1;
+        extraDigits++;
+      }
+      src++;
+    }
+    num = double(value); // the conversion rounds correctly
+    while (extraDigits-- > 0) num *= 16;
+    return src;
+  }
+  uint64_t mantissa = 0;
+  int digits = 0;   // significant digits in the mantissa
+  int exponent = 0; // power of ten to scale the mantissa by
+  bool truncated = false;
+  while (Lexer::isDigit(*src)) {
+    if (digits < 19) {
+      mantissa = mantissa * 10 + (*src - '0');
+      if (mantissa) digits++;
+    } else {
+      truncated = true;
+      exponent++;
+    }
+    src++;
+  }
+  if (*src == '.') {
+    hasDot = true;
+    src++;
+    while (Lexer::isDigit(*src)) {
+      if (digits < 19) {
+        mantissa = mantissa * 10 + (*src - '0');
+        if (mantissa) digits++;
+        exponent--;
+      } else {
+        truncated = true;
+      }
+      src++;
+    }
+  }
+  if (*src == 'e' || *src == 'E') {
+    const char *curr = src + 1;
+    bool negative = false;
+    if (*curr == '+' || *curr == '-') negative = *curr++ == '-';
+    if (Lexer::isDigit(*curr)) {
+      int value = 0;
+      while (Lexer::isDigit(*curr)) {
+        if (value < 100000) value = value * 10 + (*curr - '0'); // far outside the range of doubles already
+        curr++;
+      }
+      exponent += negative ? -value : value;
+      src = curr;
+    }
+  }
+  if (!truncated) {
+    if (mantissa == 0) {
+      num = 0;
+      return src;
+    }
+    if (exponent == 0) {
+      num = double(mantissa); // the conversion rounds correctly
+      return src;
+    }
+    if (mantissa <= MAX_EXACT_MANTISSA) {
+      if (exponent < 0 && exponent >= -MAX_EXACT_POWER_OF_TEN) {
+        num = double(mantissa) / exactPowersOfTen[-exponent];
+        return src;
+      }
+      // something like 12e25 is still exact if we move some of the power of ten into the mantissa
+      while (exponent > MAX_EXACT_POWER_OF_TEN && mantissa <= MAX_EXACT_MANTISSA / 10) {
+        mantissa *= 10;
+        exponent--;
+      }
+      if (exponent > 0 && exponent <= MAX_EXACT_POWER_OF_TEN) {
+        num = double(mantissa) * exactPowersOfTen[exponent];
+        return src;
+      }
+    }
+  }
+  char *end;
+  num = strtod(start, &end);
+  assert(end == src);
+  return src;
+}
+
+// StreamScanner
+
+static bool isKeywordToken(const char* start, const char* end, const char* keyword) {
+  return size_t(end - start) == strlen(keyword) && strncmp(start, keyword, end - start) == 0;
+}
+
+// Whether a token after a ';' or '}' at the toplevel shows that a new statement starts there. Some
+// keywords continue the statement, like else, and after a '}' anything but a name may be an operator
+// or the like (a function or object literal can end in one).
+static bool startsStatement(char candidateKind, const char* start, const char* end) {
+  if (isIdentInit(*start)) {
+    if (isKeywordToken(start, end, "else") || isKeywordToken(start, end, "while") ||
+        isKeywordToken(start, end, "catch") || isKeywordToken(start, end, "finally")) return false;
+    return candidateKind == ';' || (!isKeywordToken(start, end, "in") && !isKeywordToken(start, end, "instanceof"));
+  }
+  return candidateKind == ';';
+}
+
+StreamScanner::Event StreamScanner::next(const char* input, size_t size, bool last) {
+  const char* inputEnd = input + size;
+  while (1) {
+    // a token that reaches the end of the input may go on in the next chunk, so waits for it
+    const char* curr = skipSpaceAndComments(input + pos);
+    if (curr == inputEnd) {
+      if (!last) return MORE;
+      pos = size;
+      if (candidate) {
+        statementEnd = candidate;
+        candidate = 0;
+        return STATEMENT;
+      }
+      return MORE;
+    }
+    const char* end = skipStringOrComment(curr);
+    if (!end) {
+      if (!last) return MORE;
+      end = inputEnd; // an unterminated string
+    } else if (end == curr) {
+      if (isIdentPart(*curr)) {
+        while (isIdentPart(*end)) end++;
+      } else {
+        end++;
+      }
+      if (end == inputEnd && !last) return MORE;
+    }
+    if (candidate) {
+      bool starts = startsStatement(candidateKind, curr, end);
+      uint32_t at = candidate;
+      candidate = 0;
+      if (starts) {
+        statementEnd = at;
+        return STATEMENT; // the token is scanned again after the statement is removed
+      }
+    }
+    pos = curr - input;
+    if (needFunctionStart) {
+      functionStart = pos;
+      needFunctionStart = false;
+    }
+    char c = *curr;
+    pos = end - input;
+    if (isIdentInit(c)) {
+      if (isFunctionKeyword(curr, end)) {
+        pendingFunction = true;
+        if (bodies.size() == 1) needFunctionStart = true;
+      }
+    } else if (c == '{') {
+      if (pendingFunction) {
+        bodies.push_back(depth);
+        pendingFunction = false;
+      }
+      depth++;
+    } else if (c == '(' || c == '[') {
+      depth++;
+    } else if (c == ')' || c == ']') {
+      depth--;
+    } else if (c == '}') {
+      depth--;
+      if (!bodies.empty() && bodies.back() == depth) {
+        bodies.pop_back();
+        if (bodies.size() == 1) {
+          function.start = functionStart;
+          function.end = pos;
+          return FUNCTION;
+        }
+      }
+      if (depth == 0 && bodies.empty()) {
+        candidate = pos;
+        candidateKind = '}';
+      }
+    } else if (c == ';') {
+      if (depth == 0 && bodies.empty()) {
+        candidate = pos;
+        candidateKind = ';';
+      }
+    }
+  }
+}
+
+void StreamScanner::removeStart(uint32_t size) {
+  assert(size <= pos && depth == 0 && bodies.empty() && !candidate);
+  pos -= size;
+}
+
+void StreamScanner::removeFunctions(uint32_t size) {
+  // everything we keep track of is after the functions
+  pos -= size;
+  if (candidate) candidate -= size;
+  functionStart -= size;
+}
+
+// MappedFile
+
+#ifndef _WIN32
+
+MappedFile::MappedFile(const char* filename) : data_(nullptr), size_(0), mappedSize(0) {
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) return;
+  struct stat info;
+  if (fstat(fd, &info) == 0) {
+    // the file is mapped over the start of zeroed pages, with at least one byte to spare. The kernel
+    // zero-fills the end of the last page of the file, and if the file fills it, the page after it is
+    // the NUL
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    size_ = info.st_size;
+    mappedSize = (size_ / pageSize + 1) * pageSize;
+    void *all = mmap(nullptr, mappedSize, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (all != MAP_FAILED) {
+      if (size_ == 0 || mmap(all, size_, PROT_READ, MAP_SHARED | MAP_FIXED, fd, 0) != MAP_FAILED) {
+        data_ = (const char*)all;
+      } else {
+        munmap(all, mappedSize);
+      }
+    }
+  }
+  close(fd);
+}
+
+MappedFile::~MappedFile() {
+  if (data_) munmap((void*)data_, mappedSize);
+}
+
+#else
+
+MappedFile::MappedFile(const char* filename) : data_(nullptr), size_(0), mappedSize(0) {
+  FILE *f = fopen(filename, "rb");
+  if (!f) return;
+  fseek(f, 0, SEEK_END);
+  size_ = ftell(f);
+  rewind(f);
+  char *buffer = new char[size_ + 1];
+  size_ = fread(buffer, 1, size_, f);
+  buffer[size_] = 0;
+  fclose(f);
+  data_ = buffer;
+}
+
+MappedFile::~MappedFile() {
+  delete[] data_;
+}
+
+#endif
+
+// SourceLocations
+
+const uint8_t* SourceLocations::get(const uint8_t* p, uint64_t& value) {
+  value = 0;
+  int shift = 0;
+  while (*p & 0x80) {
+    value |= uint64_t(*p++ & 0x7f) << shift;
+    shift += 7;
+  }
+  value |= uint64_t(*p++) << shift;
+  return p;
+}
+
+void SourceLocations::reset(const char* source_, size_t size) {
+  data.clear();
+  used = 0;
+  lastNode = 0;
+  lastOffset = 0;
+  count = 0;
+  source = source_;
+  sourceSize = size;
+  index.clear();
+  lineStarts.clear();
+}
+
+bool SourceLocations::find(const void* node, uint32_t& offset) {
+  if (index.size() != count) {
+    index.clear();
+    index.reserve(count);
+    forEach([&](const void* node, uint32_t offset) {
+      index.push_back(std::make_pair(uintptr_t(node), offset));
+    });
+    // a Builder may hand back a node it was given, so one may be recorded more than once; the first
+    // record is where it starts
+    std::stable_sort(index.begin(), index.end(), [](const std::pair<uintptr_t, uint32_t>& a, const std::pair<uintptr_t, uint32_t>& b) {
+      return a.first < b.first;
+    });
+  }
+  auto it = std::lower_bound(index.begin(), index.end(), std::make_pair(uintptr_t(node), uint32_t(0)), [](const std::pair<uintptr_t, uint32_t>& a, const std::pair<uintptr_t, uint32_t>& b) {
+    return a.first < b.first;
+  });
+  if (it == index.end() || it->first != uintptr_t(node)) return false;
+  offset = it->second;
+  return true;
+}
+
+void SourceLocations::getLineColumn(uint32_t offset, uint32_t& line, uint32_t& column) {
+  if (lineStarts.empty()) {
+    lineStarts.push_back(0);
+    for (size_t i = 0; i < sourceSize; i++) {
+      if (source[i] == '\n') lineStarts.push_back(i + 1);
+    }
+  }
+  size_t i = std::upper_bound(lineStarts.begin(), lineStarts.end(), offset) - lineStarts.begin() - 1;
+  line = i + 1;
+  column = offset - lineStarts[i] + 1;
+}
 
 } // namespace cashew
 
@@ -1,11 +1,14 @@
 // Pure parsing. Calls methods on a Builder (template argument) to actually construct the AST
 //
-// XXX All parsing methods assume they take ownership of the input string. This lets them reuse
-//     parts of it. You will segfault if the input string cannot be reused and written to.
+// Input is never written to, so it can be read-only, like a MappedFile. It must end with a NUL.
 
 #include <vector>
 #include <iostream>
 #include <algorithm>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
 
 #include <stdio.h>
 
@@ -83,6 +86,9 @@ extern IString TOPLEVEL,
                OPEN_BRACE,
                OPEN_CURLY,
                CLOSE_CURLY,
+               CLOSE_PAREN,
+               CLOSE_BRACE,
+               SEMICOLON,
                COMMA,
                QUESTION,
                COLON,
@@ -122,36 +128,75 @@ struct OperatorClass {
 
 extern std::vector<OperatorClass> operatorClasses;
 
-extern bool isIdentInit(char x);
-extern bool isIdentPart(char x);
+// Character classes, looked up in a table that is generated at compile time
+enum CharClass {
+  CHAR_SPACE = 1,
+  CHAR_IDENT_INIT = 2,
+  CHAR_IDENT_PART = 4,
+  CHAR_OPERATOR_INIT = 8,
+  CHAR_SEPARATOR = 16
+};
 
-// parser
+extern const unsigned char charClasses[256];
 
-template<class NodeRef, class Builder>
-class Parser {
+inline bool hasCharClass(char x, CharClass c) { return (charClasses[(unsigned char)x] & c) != 0; }
 
-  static bool isSpace(char x) { return x == 32 || x == 9 || x == 10 || x == 13; } /* space, tab, linefeed/newline, or return */
-  static char* skipSpace(char* curr) {
-    while (*curr) {
-      if (isSpace(*curr)) {
-        curr++;
-        continue;
-      }
-      if (curr[0] == '/' && curr[1] == '/') {
-        curr += 2;
-        while (*curr && *curr != '\n') curr++;
-        if (*curr) curr++;
-        continue;
-      }
-      if (curr[0] == '/' && curr[1] == '*') {
-        curr += 2;
-        while (*curr && (curr[0] != '*' || curr[1] != '/')) curr++;
-        curr += 2;
-        continue;
-      }
-      break;
-    }
-    return curr;
+inline bool isIdentInit(char x) { return hasCharClass(x, CHAR_IDENT_INIT); }
+inline bool isIdentPart(char x) { return hasCharClass(x, CHAR_IDENT_PART); }
+
+// Returns the keyword that the size bytes at str spell, or a null IString if they are not a keyword.
+// This uses a perfect hash, and does not intern anything.
+extern IString findKeyword(const char* str, int size);
+
+// Parses a numeric literal, returning where it ends. hasDot is set if it has a '.'.
+extern const char* parseNumber(const char* src, double& num, bool& hasDot);
+
+// Skips whitespace and comments. This uses the fastest implementation the CPU supports, which can be
+// overridden with useSkipSpaceImplementation("scalar"), "sse2" or "avx2". That returns false if the
+// implementation is not available.
+extern const char* skipSpaceAndComments(const char* curr);
+extern bool useSkipSpaceImplementation(const char* name);
+
+// Errors in the input. Parsing stops at the first one, which the parser reports instead of asserting,
+// so that bad input can be discarded without taking down the process, in release builds as well.
+
+struct ParseError {
+  enum Code {
+    NONE,
+    UNEXPECTED_END, // the input ended before what was being parsed did
+    BAD_CHARACTER, // no token starts with the character at offset
+    UNEXPECTED_TOKEN // the token at offset cannot be there
+  };
+
+  Code code;
+  uint32_t offset; // into the input
+  const char *expected; // what should have been there, like ")" or "identifier", if it was one thing
+
+  ParseError() : code(NONE), offset(0), expected(nullptr) {}
+};
+
+// lexing
+
+struct Lexer {
+  // Failing unwinds the parse by throwing a Failure, which only happens on bad input, to where the
+  // parse started, where it becomes a ParseError. Valid input is parsed with no more than a branch
+  // where each assertion used to be.
+  struct Failure {
+    ParseError::Code code;
+    const char *at, *expected;
+  };
+
+  [[noreturn]] static void fail(const char* at, const char* expected=nullptr, ParseError::Code code=ParseError::UNEXPECTED_TOKEN);
+
+  // Fails unless src is at the one-character token that is expected
+  static void expect(const char* src, const char* expected) {
+    if (*src != expected[0]) fail(src, expected);
+  }
+
+  static bool isSpace(char x) { return hasCharClass(x, CHAR_SPACE); } /* space, tab, linefeed/newline, or return */
+  static const char* skipSpace(const char* curr) {
+    if (!isSpace(*curr) && *curr != '/') return curr; // usually there is nothing to skip
+    return skipSpaceAndComments(curr);
   }
 
   static bool isDigit(char x) { return x >= '0' && x <= '9'; }
@@ -189,55 +234,45 @@ class Parser {
       return type == INT || type == DOUBLE;
     }
 
-    explicit Frag(char* src) {
+    Frag() : size(0), type(SEPARATOR) {}
+
+    explicit Frag(const char* src) {
       assert(!isSpace(*src));
-      char *start = src;
+      const char *start = src;
       if (isIdentInit(*src)) {
-        // read an identifier or a keyword
+        // read an identifier or a keyword, hashing it on the way in case we need to intern it
+        uint32_t hash = IString::hashChar(IString::hashInit, *src);
         src++;
         while (isIdentPart(*src)) {
+          hash = IString::hashChar(hash, *src);
           src++;
         }
-        if (*src == 0) {
-          str.set(start);
+        str = findKeyword(start, src - start);
+        if (!str.isNull()) {
+          type = KEYWORD;
         } else {
-          char temp = *src;
-          *src = 0;
-          str.set(start, false);
-          *src = temp;
+          str.set(start, src - start, hash);
+          type = IDENT;
         }
-        type = keywords.has(str) ? KEYWORD : IDENT;
       } else if (*src == '"' || *src == '\'') {
-        char *end = strchr(src+1, *src);
-        *end = 0;
-        str.set(src+1);
+        const char *end = strchr(src+1, *src);
+        if (!end) fail(src + strlen(src), *src == '"' ? "\"" : "'");
+        uint32_t hash = IString::hashInit;
+        for (const char *curr = src+1; curr < end; curr++) hash = IString::hashChar(hash, *curr);
+        str.set(src+1, end - (src+1), hash);
         src = end+1;
         type = STRING;
       } else if (isDigit(*src) || (src[0] == '.' && isDigit(src[1]))) {
-        if (src[0] == '0' && (src[1] == 'x' || src[1] == 'X')) {
-          // Explicitly parse hex numbers of form "0x...", because strtod
-          // supports hex number strings only in C++11, and Visual Studio 2013 does
-          // not yet support that functionality.
-          src += 2;
-          num = 0;
-          while (1) {
-            if (*src >= '0' && *src <= '9') { num *= 16; num += *src - '0'; }
-            else if (*src >= 'a' && *src <= 'f') { num *= 16; num += *src - 'a' + 10; }
-            else if (*src >= 'A' && *src <= 'F') { num *= 16; num += *src - 'F' + 10; }
-            else break;
-            src++;
-          }
-        } else {
-          num = strtod(start, &src);
-        }
+        bool hasDot;
+        src = parseNumber(src, num, hasDot);
         // asm.js must have a '.' for double values. however, we also tolerate
         // uglify's tendency to emit without a '.' (and fix it later with a +).
         // for valid asm.js input, the '.' should be enough, and for uglify
         // in the emscripten optimizer pipeline, we use simple_ast where INT/DOUBLE
         // is quite the same at this point anyhow
-        type = (std::find(start, src, '.') == src && is32Bit(num)) ? INT : DOUBLE;
+        type = (!hasDot && is32Bit(num)) ? INT : DOUBLE;
         assert(src > start);
-      } else if (hasChar(OPERATOR_INITS, *src)) {
+      } else if (hasCharClass(*src, CHAR_OPERATOR_INIT)) {
         switch (*src) {
           case '!': str = src[1] == '=' ? NE : L_NOT; break;
           case '%': str = MOD; break;
@@ -259,59 +294,322 @@ class Parser {
         }
         assert(!str.isNull());
         size = strlen(str.str);
-#ifndef NDEBUG
-        char temp = start[size];
-        start[size] = 0;
-        assert(strcmp(str.str, start) == 0);
-        start[size] = temp;
-#endif
+        assert(strncmp(str.str, start, size) == 0);
         type = OPERATOR;
         return;
-      } else if (hasChar(SEPARATORS, *src)) {
+      } else if (hasCharClass(*src, CHAR_SEPARATOR)) {
+        switch (*src) {
+          case '(': str = OPEN_PAREN; break;
+          case ')': str = CLOSE_PAREN; break;
+          case '[': str = OPEN_BRACE; break;
+          case ']': str = CLOSE_BRACE; break;
+          case '{': str = OPEN_CURLY; break;
+          case '}': str = CLOSE_CURLY; break;
+          case ';': str = SEMICOLON; break;
+        }
         type = SEPARATOR;
-        char temp = src[1];
-        src[1] = 0;
-        str.set(src, false);
-        src[1] = temp;
         src++;
       } else {
-        dump("frag parsing", src);
-        assert(0);
+        fail(src, nullptr, ParseError::BAD_CHARACTER);
       }
       size = src - start;
     }
   };
 
+  static void dump(const char *where, const char* curr) {
+    /*
+    printf("%s:\n=============\n", where);
+    for (int i = 0; i < allSize; i++) printf("%c", allSource[i] ? allSource[i] : '?');
+    printf("\n");
+    for (int i = 0; i < (curr - allSource); i++) printf(" ");
+    printf("^\n=============\n");
+    */
+    fprintf(stderr, "%s:\n==========\n", where);
+    int newlinesLeft = 2;
+    int charsLeft = 200;
+    while (*curr) {
+      if (*curr == '\n') {
+        newlinesLeft--;
+        if (newlinesLeft == 0) break;
+      }
+      charsLeft--;
+      if (charsLeft == 0) break;
+      fprintf(stderr, "%c", *curr++);
+    }
+    fprintf(stderr, "\n\n");
+  }
+};
+
+// An entire input lexed ahead of time, in one pass, as a struct of arrays of Frags. A Parser given
+// this does not lex anything itself, and lexing can be measured separately from parsing.
+
+struct FragStream {
+  union Payload {
+    const char *str;
+    double num;
+  };
+
+  std::vector<unsigned char> types;
+  std::vector<Payload> payloads;
+  std::vector<uint32_t> sizes;
+  std::vector<uint32_t> offsets; // from the start of the input. has an extra entry at the end, for the end of the input
+
+  // Lexes all of src, or up to a character that starts no token, where parsing will then fail
+  void lex(const char* src);
+
+  size_t size() const { return types.size(); }
+
+  Lexer::Frag get(size_t i) const {
+    assert(i < size());
+    Lexer::Frag ret;
+    ret.type = Lexer::FragType(types[i]);
+    ret.size = sizes[i];
+    if (ret.isNumber()) ret.num = payloads[i].num;
+    else ret.str.str = payloads[i].str;
+    return ret;
+  }
+};
+
+// Finds functions that can be parsed independently of each other, for parsing in parallel. These are
+// the functions inside a toplevel function, like the functions of an asm.js module, or if a toplevel
+// function has no functions inside it, the toplevel function itself. Each is given as where the
+// function keyword is followed by the name (or the parameters), and where the body ends, in source order.
+
+struct FunctionSpan {
+  uint32_t start, end;
+};
+
+extern std::vector<FunctionSpan> findFunctions(const char* src);
+
+// Given where a function body starts, at its opening curly brace, returns where it ends, just after
+// its closing one. Returns nullptr if the body contains a function, or does not end.
+extern const char* skipFunctionBody(const char* src);
+
+// Given where a function's name (or parameters) starts, as in a FunctionSpan, returns where its body
+// ends, which may contain functions. Returns nullptr if what is before the body is not just a name and
+// parameters, or the body does not end.
+extern const char* skipFunction(const char* src);
+
+// Scans input as it arrives, for where a StreamingParser can parse something: where a toplevel statement
+// ends, or where a function inside a toplevel function ends, as findFunctions would find it. Only
+// braces and the like are followed, so a statement may be found to end later than it actually does,
+// but never earlier.
+
+struct StreamScanner {
+  enum Event {
+    MORE, // more input is needed
+    STATEMENT, // the statements before statementEnd are complete
+    FUNCTION // function is complete
+  };
+
+  uint32_t pos; // how far scanning got
+  uint32_t statementEnd;
+  FunctionSpan function;
+
+  StreamScanner() : pos(0), statementEnd(0), depth(0), candidate(0), candidateKind(0), pendingFunction(false),
+                    functionStart(0), needFunctionStart(false) {}
+
+  // Scans on from pos in the input so far, which is NUL-terminated. If last, there is no more input.
+  Event next(const char* input, size_t size, bool last);
+
+  // Updates positions after the caller removes the first size bytes of the input, which must end
+  // at a STATEMENT's end, or removes size bytes from FUNCTIONs it was given
+  void removeStart(uint32_t size);
+  void removeFunctions(uint32_t size);
+
+private:
+  int depth; // of all kinds of brackets
+  std::vector<int> bodies; // the depths of the function bodies we are inside
+  uint32_t candidate; // where a statement may end, if not 0
+  char candidateKind; // the ';' or '}' it ends with
+  bool pendingFunction; // whether the next curly brace is a function body
+  uint32_t functionStart;
+  bool needFunctionStart; // whether the next token is where a function starts
+};
+
+// A file mapped read-only into memory, so it can be parsed without copying it, followed by a NUL.
+// data() is nullptr if the file could not be opened.
+
+class MappedFile {
+  const char *data_;
+  size_t size_, mappedSize; // mappedSize is 0 if the file was read into memory instead
+
+public:
+  explicit MappedFile(const char* filename);
+  ~MappedFile();
+
+  const char* data() const { return data_; }
+  size_t size() const { return size_; }
+};
+
+// Where parsed nodes start in the source, which a Parser records if given one with setLocations. This
+// is kept apart from the nodes, so they stay as small as they are, and it is compact: each record is
+// the differences from the previous node and offset, as variable-length integers, since nodes are
+// mostly allocated one after another, near where the previous one started. Lookups decode it into
+// an index the first time they are needed.
+
+class SourceLocations {
+  std::vector<uint8_t> data;
+  size_t used; // data is grown ahead of time, so that adding does not check each byte
+  uintptr_t lastNode;
+  uint32_t lastOffset;
+  size_t count;
+
+  const char *source;
+  size_t sourceSize;
+
+  std::vector<std::pair<uintptr_t, uint32_t>> index; // nodes and their offsets, sorted by node
+  std::vector<uint32_t> lineStarts;
+
+  static uint8_t* put(uint8_t* p, uint64_t value) {
+    while (value >= 0x80) {
+      *p++ = uint8_t(value) | 0x80;
+      value >>= 7;
+    }
+    *p++ = uint8_t(value);
+    return p;
+  }
+
+  static const uint8_t* get(const uint8_t* p, uint64_t& value);
+
+  static uint64_t zigzag(int64_t value) {
+    return (uint64_t(value) << 1) ^ uint64_t(value >> 63);
+  }
+
+  static int64_t unzigzag(uint64_t value) {
+    return int64_t(value >> 1) ^ -int64_t(value & 1);
+  }
+
+public:
+  SourceLocations() { reset(nullptr, 0); }
+
+  // Forgets everything recorded, for a new parse of the given source
+  void reset(const char* source_, size_t size);
+
+  void add(const void* node, uint32_t offset) {
+    if (data.size() - used < 2 * 10) data.resize(std::max(data.size() * 2, size_t(4096))); // room for two of the longest
+    uint8_t *p = put(&data[used], zigzag(int64_t(uintptr_t(node) - lastNode)));
+    p = put(p, zigzag(int64_t(offset) - int64_t(lastOffset)));
+    used = p - data.data();
+    lastNode = uintptr_t(node);
+    lastOffset = offset;
+    count++;
+  }
+
+  // The number of records, and the bytes they take
+  size_t size() const { return count; }
+  size_t bytes() const { return used; }
+
+  // Calls func(node, offset) for each record, in the order they were made
+  template<typename Func>
+  void forEach(Func func) const {
+    const uint8_t *p = data.data(), *end = p + used;
+    uintptr_t node = 0;
+    uint32_t offset = 0;
+    while (p < end) {
+      uint64_t delta;
+      p = get(p, delta);
+      node += uintptr_t(unzigzag(delta));
+      p = get(p, delta);
+      offset += uint32_t(unzigzag(delta));
+      func((const void*)node, offset);
+    }
+  }
+
+  // Finds where a node starts. Returns false if it was not recorded.
+  bool find(const void* node, uint32_t& offset);
+
+  // The line and column of an offset in the source, both counted from 1
+  void getLineColumn(uint32_t offset, uint32_t& line, uint32_t& column);
+};
+
+// parser
+
+template<class NodeRef, class Builder>
+class StreamingParser;
+
+template<class NodeRef, class Builder>
+class Parser : private Lexer {
+
+  friend class StreamingParser<NodeRef, Builder>;
+
   // Parses an element in a list of such elements, e.g. list of statements in a block, or list of parameters in a call
-  NodeRef parseElement(char*& src, const char* seps=";") {
+  NodeRef parseElement(const char*& src, const char* seps=";") {
     //dump("parseElement", src);
     src = skipSpace(src);
-    Frag frag(src);
+    const char *start = src;
+    Frag frag = peekFrag(src);
     src += frag.size;
+    if (frag.type == KEYWORD) return at(parseAfterKeyword(frag, src, seps), start);
+    if (frag.type == IDENT) {
+      const char *next = skipSpace(src);
+      if (*next == ':') {
+        src = next;
+        return at(parseLabel(frag, src, seps), start);
+      }
+    }
+    return parseExpression(parseOperand(frag, src, seps), start, src, seps, LOWEST_PREC);
+  }
+
+  // Parses an operand of an expression: a primary, plus prefix operators before it and calls, indexing
+  // and dotting after it. Binary and tertiary operators are left for parseExpression.
+  NodeRef parseOperand(const char*& src, const char* seps) {
+    src = skipSpace(src);
+    Frag frag = peekFrag(src);
+    src += frag.size;
+    return parseOperand(frag, src, seps);
+  }
+
+  NodeRef parseOperand(Frag& first, const char*& src, const char* seps) {
+    // prefix operators are gathered first, and applied innermost first once the rest is parsed
+    size_t base = prefixStack.size();
+    Frag frag = first;
+    while (frag.type == OPERATOR) {
+      if (OperatorClass::getPrecedence(OperatorClass::Prefix, frag.str) < 0) fail(src - frag.size, "expression");
+      prefixStack.push_back(std::make_pair(frag.str, src - frag.size));
+      src = skipSpace(src);
+      frag = peekFrag(src);
+      src += frag.size;
+    }
+    const char *start = src - frag.size;
+    NodeRef ret;
     switch (frag.type) {
       case KEYWORD: {
-        return parseAfterKeyword(frag, src, seps);
+        ret = parseAfterKeyword(frag, src, seps);
+        break;
       }
       case IDENT:
       case STRING:
       case INT:
       case DOUBLE: {
-        src = skipSpace(src);
-        if (frag.type == IDENT) return parseAfterIdent(frag, src, seps);
-        else return parseExpression(parseFrag(frag), src, seps);
+        ret = parseFrag(frag);
+        break;
       }
       case SEPARATOR: {
-        if (frag.str == OPEN_PAREN) return parseExpression(parseAfterParen(src), src, seps);
-        if (frag.str == OPEN_BRACE) return parseExpression(parseAfterBrace(src), src, seps);
-        if (frag.str == OPEN_CURLY) return parseExpression(parseAfterCurly(src), src, seps);
-        assert(0);
+        if (frag.str == OPEN_PAREN) ret = parseAfterParen(src);
+        else if (frag.str == OPEN_BRACE) ret = parseAfterBrace(src);
+        else if (frag.str == OPEN_CURLY) ret = parseAfterCurly(src);
+        else fail(start, "expression");
+        break;
       }
-      case OPERATOR: {
-        return parseExpression(frag.str, src, seps);
+      default: /* dump("parseOperand", src); printf("bad frag type: %d\n", frag.type); */ assert(0);
+    }
+    at(ret, start);
+    if (frag.type != KEYWORD) {
+      while (1) {
+        src = skipSpace(src);
+        if (*src == '(') ret = parseCall(ret, src);
+        else if (*src == '[') ret = parseIndexing(ret, src);
+        else if (*src == '.' && !isDigit(src[1])) ret = parseDotting(ret, src);
+        else break;
+        at(ret, start);
       }
-      default: /* dump("parseElement", src); printf("bad frag type: %d\n", frag.type); */ assert(0);
     }
-    return nullptr;
+    while (prefixStack.size() > base) {
+      ret = at(Builder::makePrefix(prefixStack.back().first, ret), prefixStack.back().second);
+      prefixStack.pop_back();
+    }
+    return ret;
   }
 
   NodeRef parseFrag(Frag& frag) {
@@ -325,7 +623,8 @@ class Parser {
     return nullptr;
   }
 
-  NodeRef parseAfterKeyword(Frag& frag, char*& src, const char* seps) {
+  NodeRef parseAfterKeyword(Frag& frag, const char*& src, const char* seps) {
+    const char *keyword = src - frag.size;
     src = skipSpace(src);
     if (frag.str == FUNCTION) return parseFunction(frag, src, seps);
     else if (frag.str == VAR) return parseVar(frag, src, seps);
@@ -338,28 +637,30 @@ class Parser {
     else if (frag.str == CONTINUE) return parseContinue(frag, src, seps);
     else if (frag.str == SWITCH) return parseSwitch(frag, src, seps);
     else if (frag.str == NEW) return parseNew(frag, src, seps);
-    dump(frag.str.str, src);
-    assert(0);
-    return nullptr;
+    fail(keyword);
   }
 
-  NodeRef parseFunction(Frag& frag, char*& src, const char* seps) {
-    Frag name(src);
+  NodeRef parseFunction(Frag& frag, const char*& src, const char* seps) {
+    if (units) {
+      NodeRef ret;
+      if (takeUnit(src, ret)) return ret;
+    }
+    Frag name = peekFrag(src);
     if (name.type == IDENT) {
       src += name.size;
     } else {
-      assert(name.type == SEPARATOR && name.str[0] == '(');
+      if (name.type != SEPARATOR || name.str[0] != '(') fail(src, "identifier");
       name.str = IString();
     }
     NodeRef ret = Builder::makeFunction(name.str);
     src = skipSpace(src);
-    assert(*src == '(');
+    expect(src, "(");
     src++;
     while (1) {
       src = skipSpace(src);
       if (*src == ')') break;
-      Frag arg(src);
-      assert(arg.type == IDENT);
+      Frag arg = peekFrag(src);
+      if (arg.type != IDENT) fail(src, "identifier");
       src += arg.size;
       Builder::appendArgumentToFunction(ret, arg.str);
       src = skipSpace(src);
@@ -368,22 +669,50 @@ class Parser {
         src++;
         continue;
       }
-      assert(0);
+      fail(src, ")");
     }
     assert(*src == ')');
     src++;
-    parseBracketedBlock(src, ret);
+    if (lazy) {
+      src = skipSpace(src);
+      expect(src, "{");
+      const char *end = skipFunctionBody(src);
+      if (end) {
+        LazyFunction function;
+        function.node = ret;
+        function.body = src - allSource;
+        function.materialized = false;
+        lazyFunctions.push_back(function);
+        if (!!name.str) lazyByName[name.str] = lazyFunctions.size() - 1;
+        src = end;
+        return ret;
+      }
+    }
+    parseFunctionBody(src, ret);
     // TODO: parse expression?
     return ret;
   }
 
-  NodeRef parseVar(Frag& frag, char*& src, const char* seps) {
+  // Parses a function's body between Builder::enterFunction and exitFunction, so that a Builder can
+  // tell which function the nodes it builds are in
+  void parseFunctionBody(const char*& src, NodeRef func) {
+    Builder::enterFunction(func);
+    try {
+      parseBracketedBlock(src, func);
+    } catch (...) {
+      Builder::exitFunction(func);
+      throw;
+    }
+    Builder::exitFunction(func);
+  }
+
+  NodeRef parseVar(Frag& frag, const char*& src, const char* seps) {
     NodeRef ret = Builder::makeVar(frag.str == CONST);
     while (1) {
       src = skipSpace(src);
       if (*src == ';') break;
-      Frag name(src);
-      assert(name.type == IDENT);
+      Frag name = peekFrag(src);
+      if (name.type != IDENT) fail(src, "identifier");
       NodeRef value;
       src += name.size;
       src = skipSpace(src);
@@ -399,112 +728,144 @@ class Parser {
         src++;
         continue;
       }
-      assert(0);
+      fail(src, ";");
     }
     assert(*src == ';');
     src++;
     return ret;
   }
 
-  NodeRef parseReturn(Frag& frag, char*& src, const char* seps) {
+  NodeRef parseReturn(Frag& frag, const char*& src, const char* seps) {
     src = skipSpace(src);
     NodeRef value = !hasChar(seps, *src) ? parseElement(src, seps) : nullptr;
     src = skipSpace(src);
-    assert(hasChar(seps, *src));
+    if (!hasChar(seps, *src)) fail(src, ";");
     if (*src == ';') src++;
     return Builder::makeReturn(value);
   }
 
-  NodeRef parseIf(Frag& frag, char*& src, const char* seps) {
-    NodeRef condition = parseParenned(src);
-    NodeRef ifTrue = parseMaybeBracketed(src, seps);
-    src = skipSpace(src);
+  // A chain of else ifs is parsed in a loop, and built from the last if back to the first, so that long
+  // ones do not use up the native stack
+  NodeRef parseIf(Frag& frag, const char*& src, const char* seps) {
+    size_t base = ifStack.size();
     NodeRef ifFalse;
-    if (*src && !hasChar(seps, *src)) {
-      Frag next(src);
-      if (next.type == KEYWORD && next.str == ELSE) {
+    const char *start = nullptr; // the first if is where our caller knows it is
+    while (1) {
+      IfPart part;
+      part.start = start;
+      part.condition = parseParenned(src);
+      part.ifTrue = parseMaybeBracketed(src, seps);
+      ifStack.push_back(part);
+      src = skipSpace(src);
+      if (!*src || hasChar(seps, *src)) break;
+      Frag next = peekFrag(src);
+      if (next.type != KEYWORD || next.str != ELSE) break;
+      src += next.size;
+      src = skipSpace(src);
+      next = peekFrag(src);
+      if (next.type == KEYWORD && next.str == IF) {
+        start = src;
         src += next.size;
-        ifFalse = parseMaybeBracketed(src, seps);
+        continue;
+      }
+      ifFalse = parseMaybeBracketed(src, seps);
+      break;
+    }
+    while (1) {
+      IfPart& part = ifStack.back();
+      NodeRef ret = Builder::makeIf(part.condition, part.ifTrue, ifFalse);
+      start = part.start;
+      ifStack.pop_back();
+      if (ifStack.size() == base) return ret;
+      // an else if is a statement of its own, which may end with a ;
+      at(ret, start);
+      src = skipSpace(src);
+      if (*src == ';') {
+        ret = at(Builder::makeStatement(ret), start);
+        src++;
       }
+      ifFalse = ret;
     }
-    return Builder::makeIf(condition, ifTrue, ifFalse);
   }
 
-  NodeRef parseDo(Frag& frag, char*& src, const char* seps) {
+  NodeRef parseDo(Frag& frag, const char*& src, const char* seps) {
     NodeRef body = parseMaybeBracketed(src, seps);
     src = skipSpace(src);
-    Frag next(src);
-    assert(next.type == KEYWORD && next.str == WHILE);
+    Frag next = peekFrag(src);
+    if (next.type != KEYWORD || next.str != WHILE) fail(src, "while");
     src += next.size;
     NodeRef condition = parseParenned(src);
     return Builder::makeDo(body, condition);
   }
 
-  NodeRef parseWhile(Frag& frag, char*& src, const char* seps) {
+  NodeRef parseWhile(Frag& frag, const char*& src, const char* seps) {
     NodeRef condition = parseParenned(src);
     NodeRef body = parseMaybeBracketed(src, seps);
     return Builder::makeWhile(condition, body);
   }
 
-  NodeRef parseBreak(Frag& frag, char*& src, const char* seps) {
+  NodeRef parseBreak(Frag& frag, const char*& src, const char* seps) {
     src = skipSpace(src);
-    Frag next(src);
+    Frag next = peekFrag(src);
     if (next.type == IDENT) src += next.size;
     return Builder::makeBreak(next.type == IDENT ? next.str : IString());
   }
 
-  NodeRef parseContinue(Frag& frag, char*& src, const char* seps) {
+  NodeRef parseContinue(Frag& frag, const char*& src, const char* seps) {
     src = skipSpace(src);
-    Frag next(src);
+    Frag next = peekFrag(src);
     if (next.type == IDENT) src += next.size;
     return Builder::makeContinue(next.type == IDENT ? next.str : IString());
   }
 
-  NodeRef parseSwitch(Frag& frag, char*& src, const char* seps) {
+  NodeRef parseSwitch(Frag& frag, const char*& src, const char* seps) {
     NodeRef ret = Builder::makeSwitch(parseParenned(src));
     src = skipSpace(src);
-    assert(*src == '{');
+    expect(src, "{");
     src++;
+    bool hasCase = false;
     while (1) {
       // find all cases and possibly a default
       src = skipSpace(src);
       if (*src == '}') break;
-      Frag next(src);
+      Frag next = peekFrag(src);
       if (next.type == KEYWORD) {
         if (next.str == CASE) {
           src += next.size;
           src = skipSpace(src);
           NodeRef arg;
-          Frag value(src);
+          Frag value = peekFrag(src);
           if (value.isNumber()) {
             arg = parseFrag(value);
             src += value.size;
           } else {
-            assert(value.type == OPERATOR);
-            assert(value.str == MINUS);
+            if (value.type != OPERATOR || value.str != MINUS) fail(src, "number");
             src += value.size;
             src = skipSpace(src);
-            Frag value2(src);
-            assert(value2.isNumber());
+            Frag value2 = peekFrag(src);
+            if (!value2.isNumber()) fail(src, "number");
             arg = Builder::makePrefix(MINUS, parseFrag(value2));
             src += value2.size;
           }
           Builder::appendCaseToSwitch(ret, arg);
+          hasCase = true;
           src = skipSpace(src);
-          assert(*src == ':');
+          expect(src, ":");
           src++;
           continue;
         } else if (next.str == DEFAULT) {
           src += next.size;
           Builder::appendDefaultToSwitch(ret);
+          hasCase = true;
           src = skipSpace(src);
-          assert(*src == ':');
+          expect(src, ":");
           src++;
           continue;
         }
         // otherwise, may be some keyword that happens to start a block (e.g. case 1: _return_ 5)
       }
-      // not case X: or default: or }, so must be some code
+      // not case X: or default: or }, so must be some code, which must be in a case
+      if (!hasCase) fail(src, "case");
       src = skipSpace(src);
       bool explicitBlock = *src == '{';
       Builder::appendCodeToSwitch(ret, parseMaybeBracketedBlock(src, ";}", CASE, DEFAULT), explicitBlock);
@@ -515,31 +876,24 @@ class Parser {
     return ret;
   }
 
-  NodeRef parseNew(Frag& frag, char*& src, const char* seps) {
+  NodeRef parseNew(Frag& frag, const char*& src, const char* seps) {
     return Builder::makeNew(parseElement(src, seps));
   }
 
-  NodeRef parseAfterIdent(Frag& frag, char*& src, const char* seps) {
-    assert(!isSpace(*src));
-    if (*src == '(') return parseExpression(parseCall(parseFrag(frag), src), src, seps);
-    if (*src == '[') return parseExpression(parseIndexing(parseFrag(frag), src), src, seps);
-    if (*src == ':' && expressionPartsStack.back().size() == 0) {
-      src++;
-      src = skipSpace(src);
-      NodeRef inner;
-      if (*src == '{') { // context lets us know this is not an object, but a block
-        inner = parseBracketedBlock(src);
-      } else {
-        inner = parseElement(src, seps);
-      }
-      return Builder::makeLabel(frag.str, inner);
+  NodeRef parseLabel(Frag& frag, const char*& src, const char* seps) {
+    assert(*src == ':');
+    src++;
+    src = skipSpace(src);
+    NodeRef inner;
+    if (*src == '{') { // context lets us know this is not an object, but a block
+      inner = parseBracketedBlock(src);
+    } else {
+      inner = parseElement(src, seps);
     }
-    if (*src == '.') return parseExpression(parseDotting(parseFrag(frag), src), src, seps);
-    return parseExpression(parseFrag(frag), src, seps);
+    return Builder::makeLabel(frag.str, inner);
   }
 
-  NodeRef parseCall(NodeRef target, char*& src) {
-    expressionPartsStack.resize(expressionPartsStack.size()+1);
+  NodeRef parseCall(NodeRef target, const char*& src) {
     assert(*src == '(');
     src++;
     NodeRef ret = Builder::makeCall(target);
@@ -553,54 +907,46 @@ class Parser {
         src++;
         continue;
       }
-      assert(0);
+      fail(src, ")");
     }
     src++;
-    assert(expressionPartsStack.back().size() == 0);
-    expressionPartsStack.pop_back();
     return ret;
   }
 
-  NodeRef parseIndexing(NodeRef target, char*& src) {
-    expressionPartsStack.resize(expressionPartsStack.size()+1);
+  NodeRef parseIndexing(NodeRef target, const char*& src) {
     assert(*src == '[');
     src++;
     NodeRef ret = Builder::makeIndexing(target, parseElement(src, "]"));
     src = skipSpace(src);
-    assert(*src == ']');
+    expect(src, "]");
     src++;
-    assert(expressionPartsStack.back().size() == 0);
-    expressionPartsStack.pop_back();
     return ret;
   }
 
-  NodeRef parseDotting(NodeRef target, char*& src) {
+  NodeRef parseDotting(NodeRef target, const char*& src) {
     assert(*src == '.');
     src++;
-    Frag key(src);
-    assert(key.type == IDENT);
+    src = skipSpace(src);
+    Frag key = peekFrag(src);
+    if (key.type != IDENT) fail(src, "identifier");
     src += key.size;
     return Builder::makeDot(target, key.str);
   }
 
-  NodeRef parseAfterParen(char*& src) {
-    expressionPartsStack.resize(expressionPartsStack.size()+1);
+  NodeRef parseAfterParen(const char*& src) {
     src = skipSpace(src);
     NodeRef ret = parseElement(src, ")");
     src = skipSpace(src);
-    assert(*src == ')');
+    expect(src, ")");
     src++;
-    assert(expressionPartsStack.back().size() == 0);
-    expressionPartsStack.pop_back();
     return ret;
   }
 
-  NodeRef parseAfterBrace(char*& src) {
-    expressionPartsStack.resize(expressionPartsStack.size()+1);
+  NodeRef parseAfterBrace(const char*& src) {
     NodeRef ret = Builder::makeArray();
     while (1) {
       src = skipSpace(src);
-      assert(*src);
+      if (!*src) fail(src, "]");
       if (*src == ']') break;
       NodeRef element = parseElement(src, ",]");
       Builder::appendToArray(ret, element);
@@ -608,25 +954,24 @@ class Parser {
       if (*src == ',') {
         src++;
         continue;
-      } else assert(*src == ']');
+      } else expect(src, "]");
     }
     assert(*src == ']');
     src++;
     return ret;
   }
 
-  NodeRef parseAfterCurly(char*& src) {
-    expressionPartsStack.resize(expressionPartsStack.size()+1);
+  NodeRef parseAfterCurly(const char*& src) {
     NodeRef ret = Builder::makeObject();
     while (1) {
       src = skipSpace(src);
-      assert(*src);
+      if (!*src) fail(src, "}");
       if (*src == '}') break;
-      Frag key(src);
-      assert(key.type == IDENT || key.type == STRING);
+      Frag key = peekFrag(src);
+      if (key.type != IDENT && key.type != STRING) fail(src, "identifier");
       src += key.size;
       src = skipSpace(src);
-      assert(*src == ':');
+      expect(src, ":");
       src++;
       NodeRef value = parseElement(src, ",}");
       Builder::appendToObject(ret, key.str, value);
@@ -634,55 +979,13 @@ class Parser {
       if (*src == ',') {
         src++;
         continue;
-      } else assert(*src == '}');
+      } else expect(src, "}");
     }
     assert(*src == '}');
     src++;
     return ret;
   }
 
-  struct ExpressionElement {
-    bool isNode;
-#ifndef _MSC_VER // MSVC does not allow unrestricted unions: http://www.open-std.org/jtc1/sc22/wg21/docs/papers/2008/n2544.pdf
-	union {
-#endif
-      NodeRef node;
-      IString op;
-#ifndef _MSC_VER
-    };
-#endif
-    ExpressionElement(NodeRef n) : isNode(true), node(n) {}
-    ExpressionElement(IString o) : isNode(false), op(o) {}
-
-    NodeRef getNode() {
-      assert(isNode);
-      return node;
-    }
-    IString getOp() {
-      assert(!isNode);
-      return op;
-    }
-  };
-
-  // This is a list of the current stack of node-operator-node-operator-etc.
-  // this works by each parseExpression call appending to the vector; then recursing out, and the toplevel sorts it all
-  typedef std::vector<ExpressionElement> ExpressionParts;
-  std::vector<ExpressionParts> expressionPartsStack;
-
-  void dumpParts(ExpressionParts& parts, int i) {
-    printf("expressionparts: %d (at %d)\n", parts.size(), i);
-    printf("| ");
-    for (int i = 0; i < parts.size(); i++) {
-      if (parts[i].isNode) {
-        parts[i].getNode()->stringify(std::cout);
-        printf("    ");
-      } else {
-        printf("    _%s_    ", parts[i].getOp().str);
-      }
-    }
-    printf("|\n");
-  }
-
   NodeRef makeBinary(NodeRef left, IString op, NodeRef right) {
     if (op == PERIOD) {
       return Builder::makeDot(left, right);
@@ -691,102 +994,83 @@ class Parser {
     }
   }
 
-  NodeRef parseExpression(ExpressionElement initial, char*&src, const char* seps) {
+  // Parses the binary and tertiary operators that follow an operand, by precedence climbing: each
+  // operator is looked up once, and only a right-hand side that binds more tightly is parsed as an
+  // expression of its own. Operators whose precedence is looser than maxPrec are left for the caller.
+  // Rather than recursing for those right-hand sides, the operators waiting for them are kept on
+  // expressionStack, so long chains of right-to-left operators like , and = do not use up the native
+  // stack. Expressions inside this one (in parentheses, calls, etc.) use the stack above where we are.
+  NodeRef parseExpression(NodeRef left, const char* leftStart, const char*& src, const char* seps, int maxPrec) {
     //dump("parseExpression", src);
-    ExpressionParts& parts = expressionPartsStack.back();
-    src = skipSpace(src);
-    if (*src == 0 || hasChar(seps, *src)) {
-      if (parts.size() > 0) {
-        parts.push_back(initial); // cherry on top of the cake
-      }
-      return initial.getNode();
-    }
-    bool top = parts.size() == 0;
-    if (initial.isNode) {
-      Frag next(src);
-      if (next.type == OPERATOR) {
-        parts.push_back(initial);
-        src += next.size;
-        parts.push_back(next.str);
-      } else {
-        if (*src == '(') {
-          initial = parseCall(initial.getNode(), src);
-        } else if (*src == '[') {
-          initial = parseIndexing(initial.getNode(), src);
+    size_t base = expressionStack.size();
+    while (1) {
+      src = skipSpace(src);
+      bool done = *src == 0 || hasChar(seps, *src);
+      Frag next;
+      int prec = 0;
+      if (!done) {
+        next = peekFrag(src);
+        if (next.type != OPERATOR) fail(src, seps[1] ? nullptr : seps); // seps is what can end the expression
+        if (next.str == COLON) {
+          done = true; // end of the middle part of a X ? Y : Z
         } else {
-          dump("bad parseExpression state", src);
-          assert(0);
+          prec = OperatorClass::getPrecedence(next.str == QUESTION ? OperatorClass::Tertiary : OperatorClass::Binary, next.str);
+          if (prec < 0) fail(src);
+          done = prec > maxPrec;
         }
-        return parseExpression(initial, src, seps);
       }
-    } else {
-      parts.push_back(initial);
-    }
-    NodeRef last = parseElement(src, seps);
-    if (!top) return last;
-    {
-      ExpressionParts& parts = expressionPartsStack.back(); // |parts| may have been invalidated by that call
-      // we are the toplevel. sort it all out
-      // collapse right to left, highest priority first
-      //dumpParts(parts, 0);
-      for (auto& ops : operatorClasses) {
-        if (ops.rtl) {
-          // right to left
-          for (int i = parts.size()-1; i >= 0; i--) {
-            if (parts[i].isNode) continue;
-            IString op = parts[i].getOp();
-            if (!ops.ops.has(op)) continue;
-            if (ops.type == OperatorClass::Binary && i > 0 && i < (int)parts.size()-1) {
-              parts[i] = makeBinary(parts[i-1].getNode(), op, parts[i+1].getNode());
-              parts.erase(parts.begin() + i + 1);
-              parts.erase(parts.begin() + i - 1);
-            } else if (ops.type == OperatorClass::Prefix && i < (int)parts.size()-1) {
-              if (i > 0 && parts[i-1].isNode) continue; // cannot apply prefix operator if it would join two nodes
-              parts[i] = Builder::makePrefix(op, parts[i+1].getNode());
-              parts.erase(parts.begin() + i + 1);
-            } else if (ops.type == OperatorClass::Tertiary) {
-              // we must be at  X ? Y : Z
-              //                      ^
-              //dumpParts(parts, i);
-              if (op != COLON) continue;
-              assert(i < (int)parts.size()-1 && i >= 3);
-              if (parts[i-2].getOp() != QUESTION) continue; // e.g. x ? y ? 1 : 0 : 2
-              parts[i-3] = Builder::makeConditional(parts[i-3].getNode(), parts[i-1].getNode(), parts[i+1].getNode());
-              parts.erase(parts.begin() + i - 2, parts.begin() + i + 2);
-              i = parts.size(); // basically a reset, due to things like x ? y ? 1 : 0 : 2
-            } // TODO: postfix
-          }
-        } else {
-          // left to right
-          for (int i = 0; i < (int)parts.size(); i++) {
-            if (parts[i].isNode) continue;
-            IString op = parts[i].getOp();
-            if (!ops.ops.has(op)) continue;
-            if (ops.type == OperatorClass::Binary && i > 0 && i < (int)parts.size()-1) {
-              parts[i] = makeBinary(parts[i-1].getNode(), op, parts[i+1].getNode());
-              parts.erase(parts.begin() + i + 1);
-              parts.erase(parts.begin() + i - 1);
-              i--;
-            } else if (ops.type == OperatorClass::Prefix && i < (int)parts.size()-1) {
-              if (i > 0 && parts[i-1].isNode) continue; // cannot apply prefix operator if it would join two nodes
-              parts[i] = Builder::makePrefix(op, parts[i+1].getNode());
-              parts.erase(parts.begin() + i + 1);
-              i = std::max(i-2, 0); // allow a previous prefix operator to cascade
-            } // TODO: tertiary, postfix
-          }
-        }
+      if (!done) {
+        // parse the right-hand side (or the middle of a tertiary) as an expression of its own.
+        src += next.size;
+        ExpressionPart part;
+        part.left = left;
+        part.leftStart = leftStart;
+        part.op = next.str;
+        part.stage = next.str == QUESTION ? TERTIARY_MIDDLE : BINARY_RIGHT;
+        part.prec = prec;
+        part.maxPrec = maxPrec;
+        expressionStack.push_back(part);
+        src = skipSpace(src);
+        leftStart = src;
+        left = parseOperand(src, seps);
+        // a right-to-left operator takes in operators of its own precedence on the right, a left-to-right one does not
+        maxPrec = next.str == QUESTION || OperatorClass::getRtl(prec) ? prec : prec - 1;
+        continue;
       }
-      assert(parts.size() == 1);
-      NodeRef ret = parts[0].getNode();
-      parts.clear();
-      return ret;
+      // the expression we were parsing ended, and is the right-hand side of the operator under it
+      if (expressionStack.size() == base) return left;
+      ExpressionPart& part = expressionStack.back();
+      if (part.stage == TERTIARY_MIDDLE) {
+        src = skipSpace(src);
+        expect(src, ":");
+        src++;
+        part.ifTrue = left;
+        part.stage = TERTIARY_RIGHT;
+        src = skipSpace(src);
+        leftStart = src;
+        left = parseOperand(src, seps);
+        maxPrec = expressionStack.back().prec; // parsing may have grown the stack, so do not use part
+        continue;
+      }
+      if (part.stage == TERTIARY_RIGHT) {
+        left = Builder::makeConditional(part.left, part.ifTrue, left);
+      } else {
+        left = makeBinary(part.left, part.op, left);
+      }
+      leftStart = part.leftStart;
+      at(left, leftStart);
+      maxPrec = part.maxPrec;
+      expressionStack.pop_back();
     }
   }
 
   // Parses a block of code (e.g. a bunch of statements inside {,}, or the top level of o file)
-  NodeRef parseBlock(char*& src, NodeRef block=nullptr, const char* seps=";", IString keywordSep1=IString(), IString keywordSep2=IString()) {
+  NodeRef parseBlock(const char*& src, NodeRef block=nullptr, const char* seps=";", IString keywordSep1=IString(), IString keywordSep2=IString()) {
     //dump("parseBlock", src);
-    if (!block) block = Builder::makeBlock();
+    if (!block) {
+      src = skipSpace(src);
+      block = at(Builder::makeBlock(), src);
+    }
     while (*src) {
       src = skipSpace(src);
       if (*src == 0) break;
@@ -796,11 +1080,11 @@ class Parser {
       }
       if (hasChar(seps, *src)) break;
       if (!!keywordSep1) {
-        Frag next(src);
+        Frag next = peekFrag(src);
         if (next.type == KEYWORD && next.str == keywordSep1) break;
       }
       if (!!keywordSep2) {
-        Frag next(src);
+        Frag next = peekFrag(src);
         if (next.type == KEYWORD && next.str == keywordSep2) break;
       }
       NodeRef element = parseElementOrStatement(src, seps);
@@ -809,92 +1093,630 @@ class Parser {
     return block;
   }
 
-  NodeRef parseBracketedBlock(char*& src, NodeRef block=nullptr) {
-    if (!block) block = Builder::makeBlock();
+  NodeRef parseBracketedBlock(const char*& src, NodeRef block=nullptr) {
     src = skipSpace(src);
-    assert(*src == '{');
+    expect(src, "{");
+    if (!block) block = at(Builder::makeBlock(), src);
     src++;
     parseBlock(src, block, ";}"); // the two are not symmetrical, ; is just internally separating, } is the final one - parseBlock knows all this
-    assert(*src == '}');
+    expect(src, "}");
     src++;
     return block;
   }
 
-  NodeRef parseElementOrStatement(char*& src, const char *seps) {
+  NodeRef parseElementOrStatement(const char*& src, const char *seps) {
     src = skipSpace(src);
+    const char *start = src;
     if (*src == ';') {
       src++;
-      return Builder::makeBlock(); // we don't need the brackets here, but oh well
+      return at(Builder::makeBlock(), start); // we don't need the brackets here, but oh well
     }
     NodeRef ret = parseElement(src, seps);
     src = skipSpace(src);
     if (*src == ';') {
-      ret = Builder::makeStatement(ret);
+      ret = at(Builder::makeStatement(ret), start);
       src++;
     }
     return ret;
   }
 
-  NodeRef parseMaybeBracketed(char*& src, const char *seps) {
+  NodeRef parseMaybeBracketed(const char*& src, const char *seps) {
     src = skipSpace(src);
     return *src == '{' ? parseBracketedBlock(src) : parseElementOrStatement(src, seps);
   }
 
-  NodeRef parseMaybeBracketedBlock(char*& src, const char *seps, IString keywordSep1=IString(), IString keywordSep2=IString()) {
+  NodeRef parseMaybeBracketedBlock(const char*& src, const char *seps, IString keywordSep1=IString(), IString keywordSep2=IString()) {
     src = skipSpace(src);
     return *src == '{' ? parseBracketedBlock(src) : parseBlock(src, nullptr, seps, keywordSep1, keywordSep2);
   }
 
-  NodeRef parseParenned(char*& src) {
+  NodeRef parseParenned(const char*& src) {
     src = skipSpace(src);
-    assert(*src == '(');
+    expect(src, "(");
     src++;
     NodeRef ret = parseElement(src, ")");
     src = skipSpace(src);
-    assert(*src == ')');
+    expect(src, ")");
     src++;
     return ret;
   }
 
+  // Explicit stacks for parsing without native recursion. Their storage is kept from one parse to the
+  // next.
+
+  enum ExpressionStage {
+    BINARY_RIGHT,
+    TERTIARY_MIDDLE,
+    TERTIARY_RIGHT
+  };
+
+  struct ExpressionPart { // an operator waiting for the expression after it
+    NodeRef left, ifTrue;
+    const char *leftStart;
+    IString op;
+    ExpressionStage stage;
+    int prec, maxPrec; // of the operator, and of the expression it is in
+  };
+
+  std::vector<ExpressionPart> expressionStack;
+  std::vector<std::pair<IString, const char*>> prefixStack; // operators, and where they are
+
+  struct IfPart { // an if in a chain of else ifs
+    NodeRef condition, ifTrue;
+    const char *start;
+  };
+
+  std::vector<IfPart> ifStack;
+
+  // Lexing
+
+  const FragStream *frags; // if provided, all Frags are read from here instead of lexed on demand
+  size_t fragIndex; // our position in frags. parsing only moves forward, so this does too
+  const char *lastFragSrc; // when lexing on demand, the last Frag is kept, as we often look at one more than once
+  Frag lastFrag;
+
+  size_t seekFrag(const char* src) {
+    uint32_t offset = src - allSource;
+    while (frags->offsets[fragIndex] < offset) fragIndex++;
+    return fragIndex;
+  }
+
+  // Whether src is inside the Frag before frags->offsets[i], which the parser only gets to on an error,
+  // after skipping part of a Frag (like the first '=' of a '=='). From there it lexes, as it would
+  // without frags, so that it fails the same way.
+  bool insideFrag(const char* src, size_t i) {
+    return i > 0 && frags->offsets[i - 1] + frags->sizes[i - 1] > uint32_t(src - allSource);
+  }
+
+  Frag peekFrag(const char* src) {
+    if (frags) {
+      size_t i = seekFrag(src);
+      // lexing from src also handles where lexing stopped, which fails
+      if (i == frags->size() || frags->offsets[i] != uint32_t(src - allSource)) return Frag(src);
+      return frags->get(i);
+    }
+    if (src != lastFragSrc) {
+      lastFrag = Frag(src);
+      lastFragSrc = src;
+    }
+    return lastFrag;
+  }
+
+  const char* skipSpace(const char* curr) {
+    if (frags) {
+      size_t i = seekFrag(curr);
+      if (!insideFrag(curr, i)) return allSource + frags->offsets[i];
+    }
+    return Lexer::skipSpace(curr);
+  }
+
+  // Parallel parsing. Functions found by findFunctions are units, which any thread may parse. When the
+  // main parse reaches one, it uses the result instead of parsing it again; parsing a function does not
+  // depend on anything around it, so the result is the same.
+
+  enum UnitState {
+    UNCLAIMED,
+    CLAIMED,
+    DONE
+  };
+
+  struct Unit {
+    FunctionSpan span;
+    std::atomic<int> state;
+    NodeRef node;
+    uint32_t end; // where parsing the unit ended
+    bool failed; // if so, failure says why, and is passed on to the main parse when it reaches the unit
+    Failure failure;
+  };
+
+  Unit *units; // if parsing in parallel
+  size_t numUnits;
+  size_t nextUnit; // the first unit the main parse may still reach
+
+  void parseUnit(Unit& unit) {
+    Parser sub;
+    sub.allSource = allSource;
+    sub.allSize = allSize;
+    sub.frags = frags;
+    if (frags) {
+      sub.fragIndex = std::lower_bound(frags->offsets.begin(), frags->offsets.end(), unit.span.start) - frags->offsets.begin();
+    }
+    const char *src = allSource + unit.span.start;
+    Frag keyword;
+    try {
+      unit.node = sub.parseFunction(keyword, src, ";");
+    } catch (Failure& failure) {
+      unit.failed = true;
+      unit.failure = failure;
+    }
+    unit.end = src - allSource;
+    unit.state.store(DONE, std::memory_order_release);
+  }
+
+  bool claimUnit(Unit& unit) {
+    int expected = UNCLAIMED;
+    return unit.state.compare_exchange_strong(expected, CLAIMED);
+  }
+
+  // If src is where a unit starts, gets its result, and skips over it
+  bool takeUnit(const char*& src, NodeRef& ret) {
+    uint32_t offset = src - allSource;
+    while (nextUnit < numUnits && units[nextUnit].span.start < offset) nextUnit++;
+    if (nextUnit == numUnits || units[nextUnit].span.start != offset) return false;
+    Unit& unit = units[nextUnit++];
+    if (claimUnit(unit)) {
+      parseUnit(unit); // no other thread got to it yet
+    } else {
+      while (unit.state.load(std::memory_order_acquire) != DONE) std::this_thread::yield();
+    }
+    if (unit.failed) throw unit.failure;
+    ret = unit.node;
+    src = allSource + unit.end;
+    return true;
+  }
+
+  // Lazy parsing. Function bodies are skipped over, and only parsed when materialized, which is done on
+  // the same source, so it must still be around. Bodies with functions inside them are parsed right
+  // away, so a lazy function never contains another.
+
+  struct LazyFunction {
+    NodeRef node; // the function, whose body is empty until it is materialized
+    uint32_t body; // where its body starts, at the opening curly brace
+    bool materialized;
+  };
+
+  bool lazy;
+  std::vector<LazyFunction> lazyFunctions;
+  IStringMap<size_t> lazyByName;
+  size_t nextLazy; // for nextFunction
+
+  SourceLocations *locations;
+
+  // Editable parsing. The functions that findFunctions finds are parsed as units, as when parsing in
+  // parallel, and are remembered, so that when one is edited, it alone can be parsed again.
+
+  struct EditableFunction {
+    NodeRef node;
+    FunctionSpan span;
+  };
+
+  bool editable;
+  std::vector<EditableFunction> editableFunctions;
+
+  NodeRef at(NodeRef node, const char* src) {
+    if (locations) locations->add(Builder::getLocationKey(node), src - allSource);
+    return node;
+  }
+
+  ParseError error;
+
+  void setError(const Failure& failure) {
+    error.code = failure.code;
+    error.offset = failure.at - allSource;
+    error.expected = failure.expected;
+  }
+
   // Debugging
 
-  char *allSource;
+  const char *allSource;
   int allSize;
 
-  static void dump(const char *where, char* curr) {
-    /*
-    printf("%s:\n=============\n", where);
-    for (int i = 0; i < allSize; i++) printf("%c", allSource[i] ? allSource[i] : '?');
-    printf("\n");
-    for (int i = 0; i < (curr - allSource); i++) printf(" ");
-    printf("^\n=============\n");
-    */
-    fprintf(stderr, "%s:\n==========\n", where);
-    int newlinesLeft = 2;
-    int charsLeft = 200;
-    while (*curr) {
-      if (*curr == '\n') {
-        newlinesLeft--;
-        if (newlinesLeft == 0) break;
+  void start(const char* src, size_t size, const FragStream* frags_) {
+    allSource = src;
+    allSize = size;
+    frags = frags_;
+    fragIndex = 0;
+    lastFragSrc = nullptr;
+    lazyFunctions.clear();
+    lazyByName.clear();
+    nextLazy = 0;
+    if (locations) locations->reset(src, size);
+    error = ParseError();
+    expressionStack.clear(); // a failed parse may have left things here
+    prefixStack.clear();
+    ifStack.clear();
+  }
+
+public:
+
+  Parser() : frags(nullptr), fragIndex(0), lastFragSrc(nullptr), units(nullptr), numUnits(0), nextUnit(0), lazy(false), nextLazy(0), locations(nullptr), editable(false), allSource(nullptr), allSize(0) {}
+
+  // In lazy mode, function bodies are not parsed until they are materialized, so that just finding
+  // out what functions there are, and what their names and arguments are, takes a quick scan. The
+  // source must stay alive and unmodified for as long as functions may be materialized.
+  void setLazy(bool lazy_) {
+    lazy = lazy_;
+  }
+
+  // Why the last parse failed, if it did, which makes it return nullptr. A failure to materialize a
+  // function is reported here as well.
+  const ParseError& getError() {
+    return error;
+  }
+
+  // Records where nodes start in the source into locations, or stops if nullptr. Each parse starts
+  // them over, and materializing adds to them. Functions that parseToplevelParallel parses on other
+  // threads are not recorded. Nodes are recorded by what Builder::getLocationKey returns for them.
+  void setLocations(SourceLocations* locations_) {
+    locations = locations_;
+  }
+
+  // The functions whose bodies were skipped in the last parse, in source order
+  size_t numLazyFunctions() {
+    return lazyFunctions.size();
+  }
+
+  NodeRef getLazyFunction(size_t i) {
+    return lazyFunctions[i].node;
+  }
+
+  bool isMaterialized(size_t i) {
+    return lazyFunctions[i].materialized;
+  }
+
+  // Parses the body of a lazy function, if that was not done yet, and returns the function, or nullptr
+  // if its body has an error
+  NodeRef materialize(size_t i) {
+    LazyFunction& function = lazyFunctions[i];
+    if (!function.materialized) {
+      assert(!frags);
+      const char *src = allSource + function.body;
+      try {
+        parseFunctionBody(src, function.node);
+      } catch (Failure& failure) {
+        setError(failure);
+        Builder::clearFunctionBody(function.node);
+        return nullptr;
       }
-      charsLeft--;
-      if (charsLeft == 0) break;
-      fprintf(stderr, "%c", *curr++);
+      function.materialized = true;
+    }
+    return function.node;
+  }
+
+  // As above, for the last function with the given name, or nullptr if there is none
+  NodeRef materialize(IString name) {
+    size_t *i = lazyByName.find(name);
+    if (!i) return nullptr;
+    return materialize(*i);
+  }
+
+  // Returns false if a body has an error
+  bool materializeAll() {
+    for (size_t i = 0; i < lazyFunctions.size(); i++) {
+      if (!materialize(i)) return false;
+    }
+    return true;
+  }
+
+  // Frees the body of a materialized lazy function, which the Builder does in clearFunctionBody, so
+  // that only a few bodies need to be around at a time. It can be materialized again later.
+  void release(size_t i) {
+    LazyFunction& function = lazyFunctions[i];
+    if (!function.materialized) return;
+    Builder::clearFunctionBody(function.node);
+    function.materialized = false;
+  }
+
+  // Pull parsing: materializes the lazy functions one at a time, in source order, returning each, and
+  // nullptr after the last, or if one has an error
+  NodeRef nextFunction() {
+    if (nextLazy == lazyFunctions.size()) return nullptr;
+    return materialize(nextLazy++);
+  }
+
+  // In editable mode, a parse remembers where the functions that findFunctions finds are, so that after
+  // an edit inside one of them, reparse can parse just that one again. The Builder must provide
+  // replaceFunction. This does not go together with lazy mode.
+  void setEditable(bool editable_) {
+    editable = editable_;
+  }
+
+  // After an edit to the source of the last parse, which replaced the bytes from editStart to editEnd
+  // with ones that end at newEditEnd in newSrc, parses the function that the edit was inside of again,
+  // and puts it in place of the old one in ast, which is returned. If the edit was not inside one
+  // such function, or moved where it ends, all of newSrc is parsed again, and a new AST returned.
+  // newSrc ends at a NUL, like all input, and newSize is its length, which is known after an edit and
+  // saves scanning it all when just one function is parsed. Locations are not recorded.
+  NodeRef reparse(NodeRef ast, const char* newSrc, size_t newSize, uint32_t editStart, uint32_t editEnd, uint32_t newEditEnd) {
+    assert(editable && !lazy && editStart <= editEnd);
+    auto after = std::upper_bound(editableFunctions.begin(), editableFunctions.end(), editStart,
+                                  [](uint32_t offset, const EditableFunction& function) {
+      return offset < function.span.start;
+    });
+    if (after != editableFunctions.begin()) {
+      EditableFunction& function = *(after - 1);
+      // the edit must leave the start of the name and the closing curly brace alone
+      if (editStart > function.span.start && editEnd < function.span.end) {
+        int64_t delta = int64_t(newEditEnd) - int64_t(editEnd);
+        const char *end = newSrc + function.span.end + delta;
+        if (skipFunction(newSrc + function.span.start) == end) {
+          Parser sub;
+          sub.allSource = newSrc;
+          sub.allSize = newSize;
+          const char *src = newSrc + function.span.start;
+          Frag keyword;
+          NodeRef node;
+          try {
+            node = sub.parseFunction(keyword, src, ";");
+          } catch (Failure&) {
+            return parseToplevel(newSrc); // which reports the error
+          }
+          assert(src == end);
+          Builder::replaceFunction(function.node, node);
+          function.span.end += delta;
+          for (auto later = after; later != editableFunctions.end(); later++) {
+            later->span.start += delta;
+            later->span.end += delta;
+          }
+          allSource = newSrc;
+          allSize = newSize;
+          return ast;
+        }
+      }
+    }
+    return parseToplevel(newSrc);
+  }
+
+  // Highest-level parsing, as of a JavaScript script file. Returns nullptr if the input has an error,
+  // which getError describes.
+  NodeRef parseToplevel(const char* src) {
+    return parseToplevel(src, nullptr);
+  }
+
+  // As above, reading Frags from a FragStream that was lexed from src. The input always ends at a NUL,
+  // which is where the lexer stops, so there is no size to pass, even for a MappedFile.
+  NodeRef parseToplevel(const char* src, const FragStream* frags_) {
+    if (editable) return parseToplevelParallel(src, 1, frags_);
+    start(src, strlen(src), frags_);
+    NodeRef ret;
+    try {
+      ret = parseBlock(src, at(Builder::makeToplevel(), src));
+    } catch (Failure& failure) {
+      setError(failure);
+      ret = nullptr;
+    }
+    frags = nullptr;
+    return ret;
+  }
+
+  // As above, parsing functions on the given number of threads (0 for one per core), including this
+  // one. The result is the same. Other threads build with what Builder::getAllocator returns on this
+  // one in use (see UseAllocator), so that with ValueBuilder all the AST is in this thread's arena. A
+  // Builder that cannot build on several threads at once says so with buildsInParallel, and then
+  // everything is parsed on this one.
+  NodeRef parseToplevelParallel(const char* src, int threads=0, const FragStream* frags_=nullptr) {
+    if (threads <= 0) threads = std::max(1u, std::thread::hardware_concurrency());
+    if (!Builder::buildsInParallel) threads = 1;
+    std::vector<FunctionSpan> spans = findFunctions(src);
+    std::unique_ptr<Unit[]> allUnits(new Unit[spans.size()]);
+    for (size_t i = 0; i < spans.size(); i++) {
+      allUnits[i].span = spans[i];
+      allUnits[i].state.store(UNCLAIMED, std::memory_order_relaxed);
+      allUnits[i].failed = false;
+    }
+    units = allUnits.get();
+    numUnits = spans.size();
+    nextUnit = 0;
+    // workers take units in order, while this thread parses everything else, and any unit it reaches
+    // before a worker does
+    start(src, strlen(src), frags_);
+    std::atomic<size_t> nextClaim(0);
+    IStringPool *pool = IStringPool::current();
+    typename Builder::Allocator allocator = Builder::getAllocator();
+    std::vector<std::thread> workers;
+    for (int i = 1; i < threads && size_t(i) < numUnits; i++) {
+      workers.emplace_back([&]() {
+        IStringPool::Use use(pool);
+        typename Builder::UseAllocator useAllocator(allocator);
+        while (1) {
+          size_t i = nextClaim.fetch_add(1, std::memory_order_relaxed);
+          if (i >= numUnits) break;
+          if (claimUnit(units[i])) parseUnit(units[i]);
+        }
+      });
+    }
+    NodeRef ret;
+    try {
+      ret = parseBlock(src, at(Builder::makeToplevel(), src));
+    } catch (Failure& failure) {
+      setError(failure);
+      ret = nullptr;
+    }
+    nextClaim.store(numUnits, std::memory_order_relaxed); // the rest are not needed
+    for (auto& worker : workers) worker.join();
+    editableFunctions.clear();
+    if (editable && !!ret) {
+      for (size_t i = 0; i < numUnits; i++) {
+        if (units[i].state.load(std::memory_order_relaxed) != DONE) continue;
+        EditableFunction function;
+        function.node = units[i].node;
+        function.span = units[i].span;
+        editableFunctions.push_back(function);
+      }
+    }
+    frags = nullptr;
+    units = nullptr;
+    numUnits = 0;
+    return ret;
+  }
+};
+
+// Parses input that arrives in chunks, such as from a pipe. Toplevel statements are parsed as soon as
+// they end, and so are the functions inside a toplevel function, like those of an asm.js module, so
+// only input that is not parsed yet is kept around. The result is the same as parsing it all at once.
+
+template<class NodeRef, class Builder>
+class StreamingParser {
+  typedef Parser<NodeRef, Builder> ParserType;
+
+  struct Function {
+    FunctionSpan span;
+    NodeRef node;
+    uint32_t removed; // how much of its source was removed
+  };
+
+  ParserType parser;
+  std::string input;
+  uint32_t base; // where the input that is not parsed yet starts. scanning is relative to this
+  size_t shift; // how far into the whole input the input we have starts, plus what was removed before base
+  ParseError error;
+  StreamScanner scanner;
+  NodeRef toplevel;
+  std::vector<Function> functions; // parsed in the current statement
+  size_t removed; // how many of them had their source removed
+
+  const char* rest() {
+    return input.c_str() + base;
+  }
+
+  void parseFunction() {
+    ParserType sub;
+    sub.start(rest(), input.size() - base, nullptr);
+    const char *src = rest() + scanner.function.start;
+    Lexer::Frag keyword;
+    Function function;
+    function.span = scanner.function;
+    function.removed = 0;
+    function.node = sub.parseFunction(keyword, src, ";");
+    assert(src == rest() + function.span.end);
+    functions.push_back(function);
+  }
+
+  // Removes the source of parsed functions but for their closing curly braces, so that when the
+  // statement they are in is parsed, each function keyword is still followed by something. There they
+  // are units, as in parallel parsing, whose nodes are done already. This is done once scanning
+  // reaches the end of the input, in one pass over it.
+  void removeFunctions() {
+    if (removed == functions.size()) return;
+    char *data = &input[base];
+    uint32_t size = input.size() - base, to = functions[removed].span.start, total = 0;
+    for (size_t i = removed; i < functions.size(); i++) {
+      FunctionSpan& span = functions[i].span;
+      uint32_t from = span.end - 1, next = i + 1 < functions.size() ? functions[i + 1].span.start : size;
+      memmove(data + to, data + from, next - from);
+      to += next - from;
+      uint32_t removing = from - span.start;
+      functions[i].removed = removing;
+      span.start -= total;
+      span.end = span.start + 1;
+      total += removing;
+    }
+    input.resize(base + to);
+    scanner.removeFunctions(total);
+    removed = functions.size();
+  }
+
+  void parseStatements(uint32_t end) {
+    assert(removed == functions.size());
+    std::unique_ptr<typename ParserType::Unit[]> units(new typename ParserType::Unit[functions.size()]);
+    for (size_t i = 0; i < functions.size(); i++) {
+      auto& unit = units[i];
+      unit.span = functions[i].span;
+      unit.end = unit.span.end;
+      unit.node = functions[i].node;
+      unit.state.store(ParserType::DONE, std::memory_order_relaxed);
+      unit.failed = false;
+    }
+    char saved = input[base + end];
+    input[base + end] = 0;
+    parser.start(rest(), end, nullptr);
+    parser.units = units.get();
+    parser.numUnits = functions.size();
+    parser.nextUnit = 0;
+    const char *src = rest();
+    parser.parseBlock(src, toplevel);
+    parser.units = nullptr;
+    parser.numUnits = 0;
+    input[base + end] = saved;
+    base += end;
+    scanner.removeStart(end);
+    for (auto& function : functions) shift += function.removed;
+    functions.clear();
+    removed = 0;
+  }
+
+  void parse(bool last) {
+    if (error.code != ParseError::NONE) return;
+    try {
+      while (1) {
+        StreamScanner::Event event = scanner.next(rest(), input.size() - base, last);
+        if (event == StreamScanner::MORE) break;
+        if (event == StreamScanner::FUNCTION) {
+          parseFunction();
+        } else {
+          size_t size = input.size();
+          removeFunctions();
+          parseStatements(scanner.statementEnd - (size - input.size()));
+        }
+      }
+      removeFunctions();
+      if (last && base < input.size()) parseStatements(input.size() - base);
+    } catch (Lexer::Failure& failure) {
+      // where this is in the whole input, counting the source of functions that was removed before it
+      uint32_t at = failure.at - rest();
+      size_t offset = shift + base + at;
+      for (size_t i = 0; i < removed; i++) {
+        if (functions[i].span.start < at) offset += functions[i].removed;
+      }
+      error.code = failure.code;
+      error.offset = offset;
+      error.expected = failure.expected;
+      parser.units = nullptr;
+      parser.numUnits = 0;
     }
-    fprintf(stderr, "\n\n");
   }
 
 public:
+  StreamingParser() : base(0), shift(0), toplevel(Builder::makeToplevel()), removed(0) {}
+
+  // Adds a chunk of input, and parses what can be parsed. Once there is an error, input is ignored.
+  void feed(const char* chunk, size_t size) {
+    if (error.code != ParseError::NONE) return;
+    if (base > input.size() / 2) {
+      input.erase(0, base);
+      shift += base;
+      base = 0;
+    }
+    input.append(chunk, size);
+    parse(false);
+  }
 
-  Parser() : allSource(nullptr), allSize(0) {
-    expressionPartsStack.resize(1);
+  // Parses the rest, after all the input was fed, and returns the toplevel, or nullptr if the input has
+  // an error, which getError describes
+  NodeRef finish() {
+    parse(true);
+    input.clear();
+    base = 0;
+    return error.code == ParseError::NONE ? toplevel : nullptr;
   }
 
-  // Highest-level parsing, as of a JavaScript script file.
-  NodeRef parseToplevel(char* src) {
-    allSource = src;
-    allSize = strlen(src);
-    return parseBlock(src, Builder::makeToplevel());
+  const ParseError& getError() {
+    return error;
+  }
+
+  // How much of the input is kept, unparsed or not removed yet
+  size_t buffered() {
+    return input.size();
   }
 };
 
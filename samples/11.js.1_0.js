@@ -0,0 +1,10 @@
+a = b ? c : d ? e : f;
+a ? (b ? 1 : 0) : 2;
+x = a ? b : c = d;
+x = a - -b - +c * ~~d % e;
+x = !a == b | c ^ d & e;
+x = a << 1 >>> 2 >> 3 < 4 <= 5 > 6 >= 7 != 8;
+a = b = c, d = e, f;
+x = -a.b + y[1].z + f().g(2) + a.b.c(1)[2];
+x = new Foo(1);
+x = [1, 2].length + 3;
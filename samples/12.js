@@ -0,0 +1,19 @@
+function numbers() {
+ var a = 0, b = 0.0;
+ a = 0xAB | 0;
+ a = 0XFf | 0;
+ a = 0x7fffffff | 0;
+ a = HEAP32[0x1000 + 8 >> 2] | 0;
+ a = 4294967295;
+ a = 1e3;
+ b = 4294967296;
+ b = 1.5e3;
+ b = .5;
+ b = 0.1;
+ b = 1e10;
+ b = 2.5E-3;
+ b = 123456789012345678901234;
+ b = 0x10000000000000000;
+ b = 1.7976931348623157e308;
+ b = 5e-324;
+}
@@ -0,0 +1,20 @@
+function numbers() {
+ var a = 0, b = 0;
+ a = 171 | 0;
+ a = 255 | 0;
+ a = 2147483647 | 0;
+ a = HEAP32[4096 + 8 >> 2] | 0;
+ a = 4294967295;
+ a = 1e3;
+ b = 4294967296;
+ b = 1500;
+ b = .5;
+ b = .1;
+ b = 1e10;
+ b = .0025;
+ b = 123456789012345685803008;
+ b = 18446744073709551616;
+ b = 1797693134862315708145274e284;
+ b = 5e-324;
+}
+
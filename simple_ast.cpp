@@ -1,4 +1,10 @@
 
+#include <memory>
+#include <new>
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
 #include "simple_ast.h"
 
 // Ref methods
@@ -37,14 +43,278 @@ bool Ref::operator!() {
 
 // Arena
 
-Arena arena;
+thread_local Arena* Arena::currentArena = nullptr;
+
+const size_t Arena::FIRST_CHUNK, Arena::MAX_CHUNK, Arena::FIRST_BLOCK, Arena::MAX_BLOCK, Arena::HUGE_PAGE;
+
+Value::ArrayStorage Value::ArrayStorage::empty = { 0, 0 };
+
+Arena::Arena(bool hugePages) : index(0), used(0), hugePages(hugePages), reserved(0), owner(std::this_thread::get_id()) {}
+
+Arena::~Arena() {
+  reset();
+}
+
+Arena& Arena::threadDefault() {
+  // freed when the thread exits. it is also current until then, so that this is only reached once
+  static thread_local std::unique_ptr<Arena> arena(new Arena());
+  currentArena = arena.get();
+  return *arena;
+}
+
+void* Arena::allocMemory(size_t size) {
+  reserved += size;
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+  if (hugePages && size >= HUGE_PAGE) {
+    void* ret;
+    if (posix_memalign(&ret, HUGE_PAGE, size) != 0) abort();
+    madvise(ret, size, MADV_HUGEPAGE);
+    return ret;
+  }
+#endif
+  void* ret = malloc(size);
+  if (!ret) abort();
+  return ret;
+}
+
+void Arena::freeMemory(void* data, size_t size) {
+  reserved -= size;
+  ::free(data);
+}
 
 Ref Arena::alloc() {
-  if (chunks.size() == 0 || index == CHUNK_SIZE) {
-    chunks.push_back(new Value[CHUNK_SIZE]);
+  if (chunks.empty() || index == chunks.back().size) {
+    Chunk chunk;
+    chunk.size = chunks.empty() ? FIRST_CHUNK : std::min(chunks.back().size * 2, hugePages ? HUGE_PAGE / sizeof(Value) : MAX_CHUNK);
+    chunk.values = (Value*)allocMemory(chunk.size * sizeof(Value));
+    chunks.push_back(chunk);
     index = 0;
   }
-  return &chunks.back()[index++];
+  return new (&chunks.back().values[index++]) Value();
+}
+
+void* Arena::allocBlock(size_t size) {
+  // anything too big for a block gets one of its own
+  Block block;
+  block.size = std::max(size, blocks.empty() ? FIRST_BLOCK : std::min(blocks.back().size * 2, hugePages ? HUGE_PAGE : MAX_BLOCK));
+  block.data = (char*)allocMemory(block.size);
+  blocks.push_back(block);
+  used = size;
+  return block.data;
+}
+
+void Arena::freeValues(Chunk& chunk, size_t from, size_t to) {
+  // only objects have storage of their own
+  for (size_t i = from; i < to; i++) {
+    if (chunk.values[i].isObject()) chunk.values[i].free();
+  }
+}
+
+Arena* Arena::forThisThread() {
+  std::thread::id id = std::this_thread::get_id();
+  if (id == owner) return this;
+  std::lock_guard<std::mutex> lock(partsMutex);
+  for (auto& part : parts) {
+    if (part.first == id) return part.second;
+  }
+  parts.emplace_back(id, new Arena(hugePages));
+  parts.back().second->owner = id;
+  return parts.back().second;
+}
+
+void Arena::reset() {
+  rewind(Mark{0, 0, 0, 0});
+  for (auto& part : parts) delete part.second;
+  parts.clear();
+}
+
+size_t Arena::bytesReserved() {
+  std::lock_guard<std::mutex> lock(partsMutex);
+  size_t ret = reserved;
+  for (auto& part : parts) ret += part.second->bytesReserved();
+  return ret;
+}
+
+size_t Arena::bytesUsed() {
+  std::lock_guard<std::mutex> lock(partsMutex);
+  size_t ret = used;
+  for (size_t i = 0; i < chunks.size(); i++) ret += (i + 1 < chunks.size() ? chunks[i].size : index) * sizeof(Value);
+  for (size_t i = 0; i + 1 < blocks.size(); i++) ret += blocks[i].size;
+  for (auto& part : parts) ret += part.second->bytesUsed();
+  return ret;
+}
+
+void Arena::rewind(Mark mark) {
+  while (blocks.size() > mark.blocks) {
+    freeMemory(blocks.back().data, blocks.back().size);
+    blocks.pop_back();
+  }
+  used = mark.used;
+  while (chunks.size() > mark.chunks) {
+    freeValues(chunks.back(), 0, index);
+    freeMemory(chunks.back().values, chunks.back().size * sizeof(Value));
+    chunks.pop_back();
+    index = chunks.empty() ? 0 : chunks.back().size;
+  }
+  if (chunks.empty()) {
+    index = 0;
+    return;
+  }
+  freeValues(chunks.back(), mark.index, index);
+  index = mark.index;
+}
+
+// Compact AST
+
+thread_local CompactAst* CompactAst::currentAst = nullptr;
+
+const unsigned CompactAst::TYPE_BITS;
+const uint32_t CompactAst::MAX_INDEX;
+
+void CompactAst::clear() {
+  nodes.clear();
+  items.clear();
+  numbers.clear();
+}
+
+Ref CompactRef::toValue() {
+  Ref ret = Arena::current().alloc();
+  switch (CompactAst::getType(item)) {
+    case CompactAst::NULL_ITEM: break;
+    case CompactAst::STRING_ITEM: ret->setString(getIString()); break;
+    case CompactAst::INT_ITEM:
+    case CompactAst::DOUBLE_ITEM: ret->setNumber(getNumber()); break;
+    case CompactAst::BOOL_ITEM: ret->setBool(getBool()); break;
+    case CompactAst::NODE_ITEM: {
+      unsigned n = size();
+      ret->setArray(n);
+      NodeKind kind = getKind();
+      unsigned i = 0;
+      if (kind != NK_OTHER) {
+        ret->kind = kind;
+        ret->op = getOp();
+        ret->push_back(&nodeTags[kind]);
+        i = 1;
+      }
+      for (; i < n; i++) ret->push_back((*this)[i].toValue());
+      break;
+    }
+  }
+  return ret;
+}
+
+// Flat AST
+
+void FlatAst::assign(CompactRef root) {
+  clear();
+  CompactAst& ast = *root.getAst();
+  struct Pending { // a node or list whose children are being laid out
+    CompactAst::Item item;
+    uint32_t entry, child;
+  };
+  std::vector<Pending> stack;
+  auto add = [&](CompactAst::Item item) {
+    if (kinds.size() == UINT32_MAX) abort(); // too big to index
+    uint32_t entry = uint32_t(kinds.size());
+    uint8_t kind = FLAT_NULL;
+    uint32_t payload = 0;
+    switch (CompactAst::getType(item)) {
+      case CompactAst::NULL_ITEM: break;
+      case CompactAst::NODE_ITEM: {
+        CompactAst::Node& node = ast.getNode(item);
+        kind = node.kind != NK_OTHER ? node.kind : uint8_t(FLAT_LIST);
+        payload = node.op;
+        stack.push_back(Pending{ item, entry, 0 });
+        break;
+      }
+      case CompactAst::STRING_ITEM: kind = FLAT_STRING; payload = CompactAst::getIndex(item); break;
+      case CompactAst::INT_ITEM: kind = FLAT_INT; payload = CompactAst::getIndex(item); break;
+      case CompactAst::DOUBLE_ITEM: {
+        kind = FLAT_DOUBLE;
+        payload = uint32_t(numbers.size());
+        numbers.push_back(ast.getNumber(item));
+        break;
+      }
+      case CompactAst::BOOL_ITEM: kind = FLAT_BOOL; payload = CompactAst::getIndex(item); break;
+    }
+    kinds.push_back(kind);
+    payloads.push_back(payload);
+    sizes.push_back(1);
+  };
+  add(root.getItem());
+  while (!stack.empty()) {
+    Pending& top = stack.back();
+    if (top.child < ast.getNode(top.item).size) {
+      add(ast.getElement(top.item, top.child++)); // which may push onto the stack
+    } else {
+      sizes[top.entry] = uint32_t(kinds.size()) - top.entry;
+      stack.pop_back();
+    }
+  }
+}
+
+void FlatAst::clear() {
+  kinds.clear();
+  payloads.clear();
+  sizes.clear();
+  numbers.clear();
+}
+
+Ref FlatAst::toValue(uint32_t i) {
+  Ref ret = Arena::current().alloc();
+  switch (kinds[i]) {
+    case FLAT_NULL: break;
+    case FLAT_STRING: ret->setString(getIString(i)); break;
+    case FLAT_INT:
+    case FLAT_DOUBLE: ret->setNumber(getNumber(i)); break;
+    case FLAT_BOOL: ret->setBool(payloads[i]); break;
+    default: {
+      ret->setArray();
+      if (isNode(i)) {
+        ret->kind = kinds[i];
+        ret->op = payloads[i];
+        ret->push_back(&nodeTags[kinds[i]]);
+      }
+      for (uint32_t child = i + 1; child < next(i); child = next(child)) ret->push_back(toValue(child));
+    }
+  }
+  return ret;
+}
+
+// Incremental printing
+
+ParseError printIncrementally(const char *src, bool pretty, bool finalize, std::ostream& out,
+                              std::function<void (Ref)> transform) {
+  cashew::Parser<Ref, ValueBuilder> parser;
+  parser.setLazy(true);
+  Ref ast = parser.parseToplevel(src);
+  if (!ast) return parser.getError();
+  JSPrinter printer(pretty, finalize, ast);
+  printer.out = &out;
+  // lazy functions are not inside each other, and are printed in the order they were found
+  size_t next = 0;
+  Arena::Mark mark;
+  ParseError error;
+  auto isNext = [&](Ref node) {
+    return next < parser.numLazyFunctions() && parser.getLazyFunction(next).get() == node.get();
+  };
+  printer.beforeFunction = [&](Ref node) {
+    if (!isNext(node)) return;
+    mark = Arena::current().mark();
+    if (!parser.nextFunction()) {
+      if (error.code == ParseError::NONE) error = parser.getError();
+      return;
+    }
+    if (transform) transform(node);
+  };
+  printer.afterFunction = [&](Ref node) {
+    if (!isNext(node)) return;
+    parser.release(next++);
+    Arena::current().rewind(mark);
+  };
+  printer.printAst();
+  printer.flush(true);
+  return error;
 }
 
 // dump
@@ -60,10 +330,11 @@ void dump(const char *str, Ref node, bool pretty) {
 
 // Traversals
 
+template<class NodeRef>
 struct TraverseInfo {
   TraverseInfo() {}
-  TraverseInfo(Ref node) : node(node), index(0) {}
-  Ref node;
+  TraverseInfo(NodeRef node) : node(node), index(0) {}
+  NodeRef node;
   int index;
 };
 
@@ -119,19 +390,20 @@ struct StackedStack { // a stack, on the stack
 #define TRAV_STACK 40
 
 // Traverse, calling visit before the children
-void traversePre(Ref node, std::function<void (Ref)> visit) {
+template<class NodeRef, class Visit>
+static void traversePreImpl(NodeRef node, Visit& visit) {
   if (!visitable(node)) return;
   visit(node);
-  StackedStack<TraverseInfo, TRAV_STACK> stack;
-  stack.push_back(TraverseInfo(node));
+  StackedStack<TraverseInfo<NodeRef>, TRAV_STACK> stack;
+  stack.push_back(TraverseInfo<NodeRef>(node));
   while (stack.size() > 0) {
-    TraverseInfo& top = stack.back();
+    TraverseInfo<NodeRef>& top = stack.back();
     if (top.index < (int)top.node->size()) {
-      Ref sub = top.node[top.index];
+      NodeRef sub = top.node[top.index];
       top.index++;
       if (visitable(sub)) {
         visit(sub);
-        stack.push_back(TraverseInfo(sub));
+        stack.push_back(TraverseInfo<NodeRef>(sub));
       }
     } else {
       stack.pop_back();
@@ -140,19 +412,20 @@ void traversePre(Ref node, std::function<void (Ref)> visit) {
 }
 
 // Traverse, calling visitPre before the children and visitPost after
-void traversePrePost(Ref node, std::function<void (Ref)> visitPre, std::function<void (Ref)> visitPost) {
+template<class NodeRef, class VisitPre, class VisitPost>
+static void traversePrePostImpl(NodeRef node, VisitPre& visitPre, VisitPost& visitPost) {
   if (!visitable(node)) return;
   visitPre(node);
-  StackedStack<TraverseInfo, TRAV_STACK> stack;
-  stack.push_back(TraverseInfo(node));
+  StackedStack<TraverseInfo<NodeRef>, TRAV_STACK> stack;
+  stack.push_back(TraverseInfo<NodeRef>(node));
   while (stack.size() > 0) {
-    TraverseInfo& top = stack.back();
+    TraverseInfo<NodeRef>& top = stack.back();
     if (top.index < (int)top.node->size()) {
-      Ref sub = top.node[top.index];
+      NodeRef sub = top.node[top.index];
       top.index++;
       if (visitable(sub)) {
         visitPre(sub);
-        stack.push_back(TraverseInfo(sub));
+        stack.push_back(TraverseInfo<NodeRef>(sub));
       }
     } else {
       visitPost(top.node);
@@ -162,19 +435,20 @@ void traversePrePost(Ref node, std::function<void (Ref)> visitPre, std::function
 }
 
 // Traverse, calling visitPre before the children and visitPost after. If pre returns false, do not traverse children
-void traversePrePostConditional(Ref node, std::function<bool (Ref)> visitPre, std::function<void (Ref)> visitPost) {
+template<class NodeRef, class VisitPre, class VisitPost>
+static void traversePrePostConditionalImpl(NodeRef node, VisitPre& visitPre, VisitPost& visitPost) {
   if (!visitable(node)) return;
   if (!visitPre(node)) return;
-  StackedStack<TraverseInfo, TRAV_STACK> stack;
-  stack.push_back(TraverseInfo(node));
+  StackedStack<TraverseInfo<NodeRef>, TRAV_STACK> stack;
+  stack.push_back(TraverseInfo<NodeRef>(node));
   while (stack.size() > 0) {
-    TraverseInfo& top = stack.back();
+    TraverseInfo<NodeRef>& top = stack.back();
     if (top.index < (int)top.node->size()) {
-      Ref sub = top.node[top.index];
+      NodeRef sub = top.node[top.index];
       top.index++;
       if (visitable(sub)) {
         if (visitPre(sub)) {
-          stack.push_back(TraverseInfo(sub));
+          stack.push_back(TraverseInfo<NodeRef>(sub));
         }
       }
     } else {
@@ -185,20 +459,234 @@ void traversePrePostConditional(Ref node, std::function<bool (Ref)> visitPre, st
 }
 
 // Traverses all the top-level functions in the document
-void traverseFunctions(Ref ast, std::function<void (Ref)> visit) {
+template<class NodeRef, class Visit>
+static void traverseFunctionsImpl(NodeRef ast, Visit& visit) {
   if (!ast || ast->size() == 0) return;
-  if (ast[0] == TOPLEVEL) {
-    Ref stats = ast[1];
+  if (ast->getKind() == NK_TOPLEVEL) {
+    NodeRef stats = ast[1];
     for (size_t i = 0; i < stats->size(); i++) {
-      Ref curr = stats[i];
-      if (curr[0] == DEFUN) visit(curr);
+      NodeRef curr = stats[i];
+      if (curr->getKind() == NK_DEFUN) visit(curr);
     }
-  } else if (ast[0] == DEFUN) {
+  } else if (ast->getKind() == NK_DEFUN) {
     visit(ast);
   }
 }
 
-// ValueBuilder
+void traversePre(Ref node, std::function<void (Ref)> visit) {
+  traversePreImpl(node, visit);
+}
 
-IStringSet ValueBuilder::statable("assign call binary unary-prefix if name num conditional dot new sub seq string object array");
+void traversePrePost(Ref node, std::function<void (Ref)> visitPre, std::function<void (Ref)> visitPost) {
+  traversePrePostImpl(node, visitPre, visitPost);
+}
 
+void traversePrePostConditional(Ref node, std::function<bool (Ref)> visitPre, std::function<void (Ref)> visitPost) {
+  traversePrePostConditionalImpl(node, visitPre, visitPost);
+}
+
+void traverseFunctions(Ref ast, std::function<void (Ref)> visit) {
+  traverseFunctionsImpl(ast, visit);
+}
+
+void traversePre(CompactRef node, std::function<void (CompactRef)> visit) {
+  traversePreImpl(node, visit);
+}
+
+void traversePrePost(CompactRef node, std::function<void (CompactRef)> visitPre, std::function<void (CompactRef)> visitPost) {
+  traversePrePostImpl(node, visitPre, visitPost);
+}
+
+void traversePrePostConditional(CompactRef node, std::function<bool (CompactRef)> visitPre, std::function<void (CompactRef)> visitPost) {
+  traversePrePostConditionalImpl(node, visitPre, visitPost);
+}
+
+void traverseFunctions(CompactRef ast, std::function<void (CompactRef)> visit) {
+  traverseFunctionsImpl(ast, visit);
+}
+
+// Node kinds
+
+static const char* nodeKindNames[NUM_NODE_KINDS] = {
+  nullptr, "toplevel", "defun", "block", "stat", "assign", "name", "var", "conditional", "binary", "return", "if",
+  "while", "do", "sub", "call", "num", "label", "break", "continue", "switch", "string", "unary-prefix", "seq", "dot",
+  "new", "array", "object"
+};
+
+static const char* nodeOpNames[NUM_NODE_OPS] = {
+  nullptr, "+", "-", "*", "/", "%", "|", "&", "^", "<<", ">>", ">>>", "<", "<=", ">", ">=", "==", "!=", "!", "~"
+};
+
+Value nodeTags[NUM_NODE_KINDS];
+
+static IStringMap<NodeKind> nodeKinds;
+static IStringMap<NodeOp> nodeOps;
+
+static struct InitNodeKinds {
+  InitNodeKinds() {
+    for (int i = 1; i < NUM_NODE_KINDS; i++) {
+      nodeTags[i].setString(nodeKindNames[i]);
+      nodeTags[i].tag = true;
+      nodeKinds[nodeTags[i].getIString()] = NodeKind(i);
+    }
+    for (int i = 1; i < NUM_NODE_OPS; i++) nodeOps[IString(nodeOpNames[i])] = NodeOp(i);
+  }
+} initNodeKinds;
+
+NodeKind getNodeKind(IString name) {
+  NodeKind* kind = nodeKinds.find(name);
+  return kind ? *kind : NK_OTHER;
+}
+
+NodeOp getNodeOp(IString name) {
+  NodeOp* op = nodeOps.find(name);
+  return op ? *op : OP_OTHER;
+}
+
+// TypedValueBuilder
+
+thread_local std::vector<Ref> TypedValueBuilder::functions;
+
+static IString MATH_IMUL("Math_imul");
+
+static bool isIntish(AsmType type) {
+  return type == ASM_INT || type == ASM_SIGNED || type == ASM_UNSIGNED;
+}
+
+// The type a variable has when given a value of a type: int, double or float
+static AsmType declaredType(AsmType type) {
+  if (isIntish(type)) return ASM_INT;
+  if (type == ASM_DOUBLE || type == ASM_FLOAT) return type;
+  return ASM_NONE;
+}
+
+// The raw string that a parameter or local is declared with, which holds its type, or nullptr
+static Ref findLocal(Ref func, IString name) {
+  Value::ObjectStorage& locals = *func[4]->obj;
+  auto it = locals.find(name);
+  return it == locals.end() ? Ref() : it->second;
+}
+
+AsmType TypedValueBuilder::getLocalType(Ref func, IString name) {
+  assert(func->getKind() == NK_DEFUN && func->size() > 4);
+  Ref local = findLocal(func, name);
+  return local.get() ? getType(local) : ASM_NONE;
+}
+
+Ref TypedValueBuilder::makeName(IString name) {
+  Ref ret = ValueBuilder::makeName(name);
+  if (!functions.empty()) {
+    Ref local = findLocal(functions.back(), name);
+    if (local.get()) ret->asmType = local->asmType;
+  }
+  return ret;
+}
+
+Ref TypedValueBuilder::makeCall(Ref target) {
+  AsmType type = ASM_NONE;
+  if (target->getKind() == NK_NAME) {
+    IString name = NameNode(target).name();
+    if (name == MATH_FROUND) type = ASM_FLOAT;
+    else if (name == MATH_IMUL) type = ASM_SIGNED;
+  }
+  return typed(ValueBuilder::makeCall(target), type);
+}
+
+Ref TypedValueBuilder::makeStatement(Ref contents) {
+  // a call whose result is not coerced returns nothing
+  if (contents->getKind() == NK_CALL && getType(contents) == ASM_NONE) contents->asmType = ASM_VOID;
+  return ValueBuilder::makeStatement(contents);
+}
+
+Ref TypedValueBuilder::makeBinary(Ref left, IString op, Ref right) {
+  AsmType l = getType(left), r = getType(right), type = ASM_NONE;
+  if (op == SET) {
+    type = r;
+    if (left->getKind() == NK_NAME && !functions.empty()) {
+      // the first assignment to an untyped parameter is its coercion, like x = x|0
+      Ref local = findLocal(functions.back(), NameNode(left).name());
+      if (local.get()) {
+        if (local->asmType == ASM_NONE) local->asmType = declaredType(r);
+        left->asmType = local->asmType;
+      }
+    }
+  } else if (op == COMMA) {
+    type = r;
+  } else if (op == OR || op == AND || op == XOR || op == LSHIFT || op == RSHIFT) {
+    type = ASM_SIGNED;
+  } else if (op == TRSHIFT) {
+    type = ASM_UNSIGNED;
+  } else if (op == LT || op == LE || op == GT || op == GE || op == EQ || op == NE) {
+    type = ASM_INT;
+  } else if (op == PLUS || op == MINUS || op == MUL || op == DIV || op == MOD) {
+    if (l == ASM_DOUBLE || r == ASM_DOUBLE) type = ASM_DOUBLE;
+    else if (l == ASM_FLOAT || r == ASM_FLOAT) type = ASM_FLOAT;
+    else if (isIntish(l) && isIntish(r)) type = ASM_INT;
+  }
+  return typed(ValueBuilder::makeBinary(left, op, right), type);
+}
+
+Ref TypedValueBuilder::makePrefix(IString op, Ref right) {
+  AsmType r = getType(right), type = ASM_NONE;
+  if (op == PLUS) {
+    type = ASM_DOUBLE;
+  } else if (op == MINUS) {
+    type = isIntish(r) ? ASM_INT : declaredType(r);
+  } else if (op == B_NOT) {
+    type = ASM_SIGNED;
+  } else if (op == L_NOT) {
+    type = ASM_INT;
+  }
+  return typed(ValueBuilder::makePrefix(op, right), type);
+}
+
+Ref TypedValueBuilder::makeFunction(IString name) {
+  Ref ret = ValueBuilder::makeFunction(name);
+  ret->push_back(&Arena::current().alloc()->setObject());
+  return ret;
+}
+
+void TypedValueBuilder::appendArgumentToFunction(Ref func, IString arg) {
+  ValueBuilder::appendArgumentToFunction(func, arg);
+  (*func[4]->obj)[arg] = func[2]->back();
+}
+
+void TypedValueBuilder::clearFunctionBody(Ref func) {
+  ValueBuilder::clearFunctionBody(func);
+  // the locals were declared in the body, and the parameters were typed by it
+  func[4]->setObject();
+  for (unsigned i = 0; i < DefunNode(func).numParams(); i++) {
+    Ref arg = func[2][i];
+    arg->asmType = ASM_NONE;
+    (*func[4]->obj)[arg->getIString()] = arg;
+  }
+}
+
+void TypedValueBuilder::appendToVar(Ref var, IString name, Ref value) {
+  ValueBuilder::appendToVar(var, name, value);
+  Ref local = var[1]->back()[0];
+  if (!!value) local->asmType = declaredType(getType(value));
+  if (!functions.empty()) (*functions.back()[4]->obj)[name] = local;
+}
+
+Ref TypedValueBuilder::makeIndexing(Ref target, Ref index) {
+  AsmType type = ASM_NONE;
+  if (target->getKind() == NK_NAME) {
+    IString view = NameNode(target).name();
+    if (view == HEAP8 || view == HEAP16 || view == HEAP32 || view == HEAPU8 || view == HEAPU16 || view == HEAPU32) {
+      type = ASM_INT;
+    } else if (view == HEAPF32) {
+      type = ASM_FLOAT;
+    } else if (view == HEAPF64) {
+      type = ASM_DOUBLE;
+    }
+  }
+  return typed(ValueBuilder::makeIndexing(target, index), type);
+}
+
+Ref TypedValueBuilder::makeConditional(Ref condition, Ref ifTrue, Ref ifFalse) {
+  AsmType t = getType(ifTrue), f = getType(ifFalse), type = ASM_NONE;
+  if (t == f) type = t;
+  else if (isIntish(t) && isIntish(f)) type = ASM_INT;
+  return typed(ValueBuilder::makeConditional(condition, ifTrue, ifFalse), type);
+}
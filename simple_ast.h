@@ -14,6 +14,8 @@
 #include <set>
 #include <unordered_set>
 #include <unordered_map>
+#include <thread>
+#include <mutex>
 
 #include "parser.h"
 
@@ -53,19 +55,204 @@ struct Ref {
   bool operator!(); // check if null, in effect
 };
 
-// Arena allocation, free it all on process exit
+// Arena allocation. Values, and the elements of arrays, are allocated from the current thread's arena,
+// which is its own default one (which is freed when the thread exits, so an AST that outlives the
+// thread that builds it must be built in another arena), or one that it is told to use (see Use). An
+// arena frees everything in it at once, on reset or when destroyed. Threads allocate from an arena
+// without locking: a thread that uses an arena that another thread made gets a part of it of its
+// own, so several threads can build ASTs in the same arena at once.
+
+class Arena {
+  // Each allocation is twice as big as the one before it, up to a limit. The limits are kept
+  // small enough that malloc reuses freed memory rather than returning it to the system, as
+  // otherwise each parse after a reset pays to fault it all in again. With huge pages, they are
+  // the size of a huge page instead.
+  static const size_t FIRST_CHUNK = 1024, MAX_CHUNK = 8*1024; // in Values
+  static const size_t FIRST_BLOCK = 64*1024, MAX_BLOCK = 1024*1024; // in bytes
+  static const size_t HUGE_PAGE = 2*1024*1024;
+
+  struct Chunk {
+    Value* values;
+    size_t size;
+  };
+  std::vector<Chunk> chunks;
+  size_t index; // in last chunk
+
+  // Raw storage, for the elements of arrays
+  struct Block {
+    char* data;
+    size_t size;
+  };
+  std::vector<Block> blocks;
+  size_t used; // in last block
+
+  bool hugePages;
+  size_t reserved; // bytes in chunks and blocks
+
+  // the parts of this arena that other threads use
+  std::thread::id owner;
+  std::mutex partsMutex;
+  std::vector<std::pair<std::thread::id, Arena*>> parts;
+
+  static thread_local Arena* currentArena;
 
-struct Arena {
-  #define CHUNK_SIZE 1000
-  std::vector<Value*> chunks;
-  int index; // in last chunk
+  static Arena& threadDefault();
 
-  Arena() : index(0) {}
+  void* allocMemory(size_t size);
+  void freeMemory(void* data, size_t size);
+  void* allocBlock(size_t size);
+  void freeValues(Chunk& chunk, size_t from, size_t to);
+  Arena* forThisThread();
+
+public:
+  // With hugePages, big allocations are backed by transparent huge pages, where the system has them
+  Arena(bool hugePages=false);
+  ~Arena();
+
+  Arena(const Arena&) = delete;
+  Arena& operator=(const Arena&) = delete;
+
+  // The arena that this thread allocates from
+  static Arena& current() {
+    Arena* ret = currentArena;
+    return ret ? *ret : threadDefault();
+  }
+
+  // Makes this thread allocate from an arena while in scope
+  class Use {
+    Arena* previous;
+
+  public:
+    Use(Arena* arena) : previous(currentArena) {
+      currentArena = arena->forThisThread();
+    }
+    ~Use() {
+      currentArena = previous;
+    }
+  };
 
   Ref alloc();
+
+  // size must be a multiple of 8
+  void* allocBytes(size_t size) {
+    if (blocks.empty() || used + size > blocks.back().size) return allocBlock(size);
+    void* ret = blocks.back().data + used;
+    used += size;
+    return ret;
+  }
+
+  // Frees everything that was allocated in the arena, by all threads. Nothing else may be using it.
+  void reset();
+
+  // Bytes taken from the system, and bytes of those that are in use, by all threads
+  size_t bytesReserved();
+  size_t bytesUsed();
+
+  // Everything allocated after a mark can be freed by rewinding to it, if nothing allocated before it
+  // still refers to any of it. Growing an array that was allocated before the mark allocates after it.
+  // Only what this thread allocated is rewound.
+  struct Mark {
+    size_t chunks;
+    size_t index;
+    size_t blocks;
+    size_t used;
+  };
+
+  Mark mark() {
+    Mark ret;
+    ret.chunks = chunks.size();
+    ret.index = index;
+    ret.blocks = blocks.size();
+    ret.used = used;
+    return ret;
+  }
+
+  void rewind(Mark mark);
 };
 
-extern Arena arena;
+// asm.js types of expressions, as TypedValueBuilder infers them
+enum AsmType {
+  ASM_NONE = 0, // not known, or not an expression
+  ASM_INT,      // int, or an intish result that still needs a coercion
+  ASM_SIGNED,
+  ASM_UNSIGNED,
+  ASM_DOUBLE,
+  ASM_FLOAT,
+  ASM_VOID
+};
+
+// Kinds of AST nodes. ValueBuilder notes the kind in each node it builds, so that code can switch on
+// it (see Value::getKind) instead of comparing node[0] with strings. node[0] is still there.
+enum NodeKind {
+  NK_OTHER = 0, // not a node
+  NK_TOPLEVEL,
+  NK_DEFUN,
+  NK_BLOCK,
+  NK_STAT,
+  NK_ASSIGN,
+  NK_NAME,
+  NK_VAR,
+  NK_CONDITIONAL,
+  NK_BINARY,
+  NK_RETURN,
+  NK_IF,
+  NK_WHILE,
+  NK_DO,
+  NK_SUB,
+  NK_CALL,
+  NK_NUM,
+  NK_LABEL,
+  NK_BREAK,
+  NK_CONTINUE,
+  NK_SWITCH,
+  NK_STRING,
+  NK_UNARY_PREFIX,
+  NK_SEQ,
+  NK_DOT,
+  NK_NEW,
+  NK_ARRAY,
+  NK_OBJECT,
+  NUM_NODE_KINDS
+};
+
+// Operators of binary and unary-prefix nodes, which are noted like kinds are (see Value::getOp)
+enum NodeOp {
+  OP_OTHER = 0,
+  OP_PLUS,
+  OP_MINUS,
+  OP_MUL,
+  OP_DIV,
+  OP_MOD,
+  OP_OR,
+  OP_AND,
+  OP_XOR,
+  OP_LSHIFT,
+  OP_RSHIFT,
+  OP_TRSHIFT,
+  OP_LT,
+  OP_LE,
+  OP_GT,
+  OP_GE,
+  OP_EQ,
+  OP_NE,
+  OP_L_NOT,
+  OP_B_NOT,
+  NUM_NODE_OPS
+};
+
+// Kinds and operators by their names, or NK_OTHER and OP_OTHER
+NodeKind getNodeKind(IString name);
+NodeOp getNodeOp(IString name);
+
+// Whether a node of a kind is wrapped in a stat node when it is a statement
+inline bool needsStatement(NodeKind kind) {
+  switch (kind) {
+    case NK_ASSIGN: case NK_CALL: case NK_BINARY: case NK_UNARY_PREFIX: case NK_IF: case NK_NAME: case NK_NUM:
+    case NK_CONDITIONAL: case NK_DOT: case NK_NEW: case NK_SUB: case NK_SEQ: case NK_STRING: case NK_OBJECT:
+    case NK_ARRAY: return true;
+    default: return false; // only very specific things actually need to be stat'ed
+  }
+}
 
 // Main value type
 struct Value {
@@ -79,8 +266,32 @@ struct Value {
   };
 
   Type type;
+  unsigned char asmType; // an AsmType, set by TypedValueBuilder. Sits in padding, so it is free
+  unsigned char kind, op; // a NodeKind and NodeOp, set by ValueBuilder. Also in padding
+  bool tag; // whether this is one of the nodeTags, which cannot change. Also in padding
+
+  // The elements of an array are in the arena, right after a small header, so that making an array of
+  // known size is a bump allocation. An array that outgrows its capacity moves to a new allocation
+  // twice as big, and the old one is not reused.
+  struct ArrayStorage {
+    uint32_t used, capacity;
+
+    static ArrayStorage empty; // shared by all the arrays that have nothing in them yet
+
+    static ArrayStorage* make(uint32_t capacity) {
+      if (capacity == 0) return &empty;
+      ArrayStorage* ret = (ArrayStorage*)Arena::current().allocBytes(sizeof(ArrayStorage) + capacity * sizeof(Ref));
+      ret->used = 0;
+      ret->capacity = capacity;
+      return ret;
+    }
 
-  typedef std::vector<Ref> ArrayStorage;
+    unsigned size() { return used; }
+    Ref* begin() { return (Ref*)(this + 1); }
+    Ref* end() { return begin() + used; }
+    Ref& operator[](unsigned x) { return begin()[x]; }
+    Ref& back() { return begin()[used - 1]; }
+  };
   typedef std::unordered_map<IString, Ref> ObjectStorage;
 
 #ifdef _MSC_VER // MSVC does not allow unrestricted unions: http://www.open-std.org/jtc1/sc22/wg21/docs/papers/2008/n2544.pdf
@@ -97,27 +308,29 @@ struct Value {
   };
 
   // constructors all copy their input
-  Value() : type(Null), num(0) {}
-  explicit Value(const char *s) : type(Null) {
+  Value() : type(Null), asmType(ASM_NONE), kind(NK_OTHER), op(OP_OTHER), tag(false), num(0) {}
+  explicit Value(const char *s) : type(Null), tag(false) {
     setString(s);
   }
-  explicit Value(double n) : type(Null) {
+  explicit Value(double n) : type(Null), tag(false) {
     setNumber(n);
   }
-  explicit Value(ArrayStorage &a) : type(Null) {
-    setArray();
-    *arr = a;
+  explicit Value(ArrayStorage &a) : type(Null), tag(false) {
+    setArray(a);
   }
   // no bool constructor - would endanger the double one (int might convert the wrong way)
 
   ~Value() {
-    free();
+    if (!tag) free();
   }
 
   void free() {
-    if (type == Array) delete arr;
-    else if (type == Object) delete obj;
+    if (tag) abort(); // a tag is shared by all nodes of its kind, so changing it would rename them all
+    if (type == Object) delete obj; // arrays are in the arena
     type = Null;
+    asmType = ASM_NONE;
+    kind = NK_OTHER;
+    op = OP_OTHER;
     num = 0;
   }
 
@@ -140,16 +353,15 @@ struct Value {
     return *this;
   }
   Value& setArray(ArrayStorage &a) {
-    free();
-    type = Array;
-    arr = new ArrayStorage();
-    *arr = a;
+    setArray(a.size());
+    std::copy(a.begin(), a.end(), arr->begin());
+    arr->used = a.size();
     return *this;
   }
-  Value& setArray() {
+  Value& setArray(unsigned capacity=0) { // capacity is how many elements fit before it must grow
     free();
     type = Array;
-    arr = new ArrayStorage();
+    arr = ArrayStorage::make(capacity);
     return *this;
   }
   Value& setNull() {
@@ -228,6 +440,9 @@ struct Value {
       case Object:
         assert(0); // TODO
     }
+    asmType = other.asmType;
+    kind = other.kind;
+    op = other.op;
     return *this;
   }
 
@@ -289,8 +504,8 @@ struct Value {
       skip();
       setArray();
       while (*curr != ']') {
-        Ref temp = arena.alloc();
-        arr->push_back(temp);
+        Ref temp = Arena::current().alloc();
+        push_back(temp);
         curr = temp->parse(curr);
         skip();
         if (*curr == ']') break;
@@ -331,7 +546,7 @@ struct Value {
         assert(*curr == ':');
         curr++;
         skip();
-        Ref value = arena.alloc();
+        Ref value = Arena::current().alloc();
         curr = value->parse(curr);
         (*obj)[key] = value;
         skip();
@@ -425,6 +640,13 @@ struct Value {
 
   // Array operations
 
+  // The kind of node this is. Nodes that were not built by ValueBuilder (parsed from JSON, say), and
+  // nodes whose node[0] was replaced since, are looked up by their node[0]
+  NodeKind getKind();
+
+  // The operator of a binary or unary-prefix node
+  NodeOp getOp();
+
   unsigned size() {
     assert(isArray());
     return arr->size();
@@ -433,14 +655,25 @@ struct Value {
   void setSize(unsigned size) {
     assert(isArray());
     unsigned old = arr->size();
-    if (old != size) arr->resize(size);
+    if (old == size) return;
+    reserve(size);
+    arr->used = size;
     if (old < size) {
       for (unsigned i = old; i < size; i++) {
-        (*arr)[i] = arena.alloc();
+        (*arr)[i] = Arena::current().alloc();
       }
     }
   }
 
+  void reserve(unsigned size) {
+    assert(isArray());
+    if (size <= arr->capacity) return;
+    ArrayStorage* old = arr;
+    arr = ArrayStorage::make(std::max(size, std::max(old->capacity * 2, 4u)));
+    std::copy(old->begin(), old->end(), arr->begin());
+    arr->used = old->used;
+  }
+
   Ref& operator[](unsigned x) {
     assert(isArray());
     assert(x < arr->size());
@@ -449,13 +682,14 @@ struct Value {
 
   Value& push_back(Ref r) {
     assert(isArray());
-    arr->push_back(r);
+    if (arr->used == arr->capacity) reserve(arr->used + 1);
+    arr->begin()[arr->used++] = r;
     return *this;
   }
   Ref pop_back() {
     assert(isArray());
     Ref ret = arr->back();
-    arr->pop_back();
+    arr->used--;
     return ret;
   }
 
@@ -467,14 +701,20 @@ struct Value {
 
   void splice(int x, int num) {
     assert(isArray());
-    arr->erase(arr->begin() + x, arr->begin() + x + num);
+    std::copy(arr->begin() + x + num, arr->end(), arr->begin() + x);
+    arr->used -= num;
   }
 
   void insert(int x, int num) {
-    arr->insert(arr->begin() + x, num, Ref());
+    assert(isArray());
+    reserve(arr->used + num);
+    std::copy_backward(arr->begin() + x, arr->end(), arr->end() + num);
+    std::fill(arr->begin() + x, arr->begin() + x + num, Ref());
+    arr->used += num;
   }
   void insert(int x, Ref node) {
-    arr->insert(arr->begin() + x, 1, node);
+    insert(x, 1);
+    (*arr)[x] = node;
   }
 
   int indexOf(Ref other) {
@@ -487,8 +727,8 @@ struct Value {
 
   Ref map(std::function<Ref (Ref node)> func) {
     assert(isArray());
-    Ref ret = arena.alloc();
-    ret->setArray();
+    Ref ret = Arena::current().alloc();
+    ret->setArray(arr->size());
     for (unsigned i = 0; i < arr->size(); i++) {
       ret->push_back(func((*arr)[i]));
     }
@@ -497,7 +737,7 @@ struct Value {
 
   Ref filter(std::function<bool (Ref node)> func) {
     assert(isArray());
-    Ref ret = arena.alloc();
+    Ref ret = Arena::current().alloc();
     ret->setArray();
     for (unsigned i = 0; i < arr->size(); i++) {
       Ref curr = (*arr)[i];
@@ -531,6 +771,100 @@ struct Value {
   }
 };
 
+// The tags of nodes of each kind, by NodeKind, which their node[0]s all point to. They cannot change, as
+// that would rename every node of the kind; to change a node's kind, give it a new node[0].
+extern Value nodeTags[NUM_NODE_KINDS];
+
+inline NodeKind Value::getKind() {
+  if (kind != NK_OTHER && arr->size() > 0 && (*arr)[0].get() == &nodeTags[kind]) return NodeKind(kind);
+  if (!isArray() || arr->size() == 0 || !(*arr)[0]->isString()) return NK_OTHER;
+  return getNodeKind((*arr)[0]->getIString());
+}
+
+inline NodeOp Value::getOp() {
+  NodeKind k = getKind();
+  if (k != NK_BINARY && k != NK_UNARY_PREFIX) return OP_OTHER;
+  if (k == kind && op != OP_OTHER) return NodeOp(op);
+  return getNodeOp((*arr)[1]->getIString());
+}
+
+// Typed views of nodes of the common kinds, which name their parts instead of indexing them. A view is
+// just the Ref, whose kind is checked when the view is made (in debug builds)
+
+struct NameNode {
+  Ref node;
+  NameNode(Ref node) : node(node) { assert(node->getKind() == NK_NAME); }
+  IString name() { return node[1]->getIString(); }
+};
+
+struct NumNode {
+  Ref node;
+  NumNode(Ref node) : node(node) { assert(node->getKind() == NK_NUM); }
+  double value() { return node[1]->getNumber(); }
+};
+
+struct BinaryNode {
+  Ref node;
+  BinaryNode(Ref node) : node(node) { assert(node->getKind() == NK_BINARY); }
+  NodeOp op() { return node->getOp(); }
+  Ref left() { return node[2]; }
+  Ref right() { return node[3]; }
+};
+
+struct UnaryPrefixNode {
+  Ref node;
+  UnaryPrefixNode(Ref node) : node(node) { assert(node->getKind() == NK_UNARY_PREFIX); }
+  NodeOp op() { return node->getOp(); }
+  Ref value() { return node[2]; }
+};
+
+struct AssignNode {
+  Ref node;
+  AssignNode(Ref node) : node(node) { assert(node->getKind() == NK_ASSIGN); }
+  Ref target() { return node[2]; }
+  Ref value() { return node[3]; }
+};
+
+struct CallNode {
+  Ref node;
+  CallNode(Ref node) : node(node) { assert(node->getKind() == NK_CALL); }
+  Ref target() { return node[1]; }
+  unsigned numArgs() { return node[2]->size(); }
+  Ref arg(unsigned i) { return node[2][i]; }
+};
+
+struct SubNode {
+  Ref node;
+  SubNode(Ref node) : node(node) { assert(node->getKind() == NK_SUB); }
+  Ref target() { return node[1]; }
+  Ref index() { return node[2]; }
+};
+
+struct ConditionalNode {
+  Ref node;
+  ConditionalNode(Ref node) : node(node) { assert(node->getKind() == NK_CONDITIONAL); }
+  Ref condition() { return node[1]; }
+  Ref ifTrue() { return node[2]; }
+  Ref ifFalse() { return node[3]; }
+};
+
+struct IfNode {
+  Ref node;
+  IfNode(Ref node) : node(node) { assert(node->getKind() == NK_IF); }
+  Ref condition() { return node[1]; }
+  Ref ifTrue() { return node[2]; }
+  Ref ifFalse() { return node[3]; } // a null Value if there is no else
+};
+
+struct DefunNode {
+  Ref node;
+  DefunNode(Ref node) : node(node) { assert(node->getKind() == NK_DEFUN); }
+  IString name() { return node[1]->getIString(); }
+  unsigned numParams() { return node[2]->size(); }
+  IString param(unsigned i) { return node[2][i]->getIString(); }
+  Ref body() { return node[3]; } // an array of statements
+};
+
 // AST traversals
 
 // Traverse, calling visit before the children
@@ -545,9 +879,10 @@ void traversePrePostConditional(Ref node, std::function<bool (Ref)> visitPre, st
 // Traverses all the top-level functions in the document
 void traverseFunctions(Ref ast, std::function<void (Ref)> visit);
 
-// JS printer
+// JS printer. It works on any AST with the same shape and accessors as the simple AST, see CompactRef
 
-struct JSPrinter {
+template<class NodeRef>
+struct BasicJSPrinter {
   bool pretty, finalize;
 
   char *buffer;
@@ -556,15 +891,37 @@ struct JSPrinter {
   int indent;
   bool possibleSpace; // add a space to separate identifiers
 
-  Ref ast;
+  NodeRef ast;
+
+  // Incremental printing. If out is set, what is printed so far is written there after each function,
+  // and not kept in buffer. beforeFunction and afterFunction are called around printing each function,
+  // and can for example parse its body and then free it.
+  std::ostream *out;
+  size_t flushed; // how much was written to out
+  std::function<void (NodeRef)> beforeFunction, afterFunction;
 
-  JSPrinter(bool pretty_, bool finalize_, Ref ast_) : pretty(pretty_), finalize(finalize_), buffer(0), size(0), used(0), indent(0), possibleSpace(false), ast(ast_) {}
+  BasicJSPrinter(bool pretty_, bool finalize_, NodeRef ast_) : pretty(pretty_), finalize(finalize_), buffer(0), size(0), used(0), indent(0), possibleSpace(false), ast(ast_), out(nullptr), flushed(0) {}
 
   void printAst() {
     print(ast);
     buffer[used] = 0;
   }
 
+  // Writes the buffer to out. The last character is kept, unless all is, as it is looked at when
+  // emitting more.
+  void flush(bool all=false) {
+    int keep = all ? 0 : std::min(used, 1);
+    out->write(buffer, used - keep);
+    flushed += used - keep;
+    memmove(buffer, buffer + used - keep, keep);
+    used = keep;
+  }
+
+  // Where we are in all of the output, including what was flushed
+  size_t position() {
+    return flushed + used;
+  }
+
   // Utils
 
   void ensure(int safety=100) {
@@ -603,6 +960,14 @@ struct JSPrinter {
     used += len;
   }
 
+  void emit(IString s) { // interned strings know their length
+    maybeSpace(s[0]);
+    int len = s.size();
+    ensure(len+1);
+    memcpy(buffer + used, s.str, len+1);
+    used += len;
+  }
+
   void newline() {
     if (!pretty) return;
     emit('\n');
@@ -625,111 +990,54 @@ struct JSPrinter {
     }
   }
 
-  void print(Ref node) {
+  void print(NodeRef node) {
     ensure();
-    IString type = node[0]->getIString();
-    //fprintf(stderr, "printing %s\n", type.str);
-    switch (type.str[0]) {
-      case 'a': {
-        if (type == ASSIGN) printAssign(node);
-        else if (type == ARRAY) printArray(node);
-        else assert(0);
-        break;
-      }
-      case 'b': {
-        if (type == BINARY) printBinary(node);
-        else if (type == BLOCK) printBlock(node);
-        else if (type == BREAK) printBreak(node);
-        else assert(0);
-        break;
-      }
-      case 'c': {
-        if (type == CALL) printCall(node);
-        else if (type == CONDITIONAL) printConditional(node);
-        else if (type == CONTINUE) printContinue(node);
-        else assert(0);
-        break;
-      }
-      case 'd': {
-        if (type == DEFUN) printDefun(node);
-        else if (type == DO) printDo(node);
-        else if (type == DOT) printDot(node);
-        else assert(0);
-        break;
-      }
-      case 'i': {
-        if (type == IF) printIf(node);
-        else assert(0);
-        break;
-      }
-      case 'l': {
-        if (type == LABEL) printLabel(node);
-        else assert(0);
-        break;
-      }
-      case 'n': {
-        if (type == NAME) printName(node);
-        else if (type == NUM) printNum(node);
-        else if (type == NEW) printNew(node);
-        else assert(0);
-        break;
-      }
-      case 'o': {
-        if (type == OBJECT) printObject(node);
-        break;
-      }
-      case 'r': {
-        if (type == RETURN) printReturn(node);
-        else assert(0);
-        break;
-      }
-      case 's': {
-        if (type == STAT) printStat(node);
-        else if (type == SUB) printSub(node);
-        else if (type == SEQ) printSeq(node);
-        else if (type == SWITCH) printSwitch(node);
-        else if (type == STRING) printString(node);
-        else assert(0);
-        break;
-      }
-      case 't': {
-        if (type == TOPLEVEL) printToplevel(node);
-        else assert(0);
-        break;
-      }
-      case 'u': {
-        if (type == UNARY_PREFIX) printUnaryPrefix(node);
-        else assert(0);
-        break;
-      }
-      case 'v': {
-        if (type == VAR) printVar(node);
-        else assert(0);
-        break;
-      }
-      case 'w': {
-        if (type == WHILE) printWhile(node);
-        else assert(0);
-        break;
-      }
+    switch (node->getKind()) {
+      case NK_ASSIGN:       printAssign(node); break;
+      case NK_ARRAY:        printArray(node); break;
+      case NK_BINARY:       printBinary(node); break;
+      case NK_BLOCK:        printBlock(node); break;
+      case NK_BREAK:        printBreak(node); break;
+      case NK_CALL:         printCall(node); break;
+      case NK_CONDITIONAL:  printConditional(node); break;
+      case NK_CONTINUE:     printContinue(node); break;
+      case NK_DEFUN:        printDefun(node); break;
+      case NK_DO:           printDo(node); break;
+      case NK_DOT:          printDot(node); break;
+      case NK_IF:           printIf(node); break;
+      case NK_LABEL:        printLabel(node); break;
+      case NK_NAME:         printName(node); break;
+      case NK_NUM:          printNum(node); break;
+      case NK_NEW:          printNew(node); break;
+      case NK_OBJECT:       printObject(node); break;
+      case NK_RETURN:       printReturn(node); break;
+      case NK_STAT:         printStat(node); break;
+      case NK_SUB:          printSub(node); break;
+      case NK_SEQ:          printSeq(node); break;
+      case NK_SWITCH:       printSwitch(node); break;
+      case NK_STRING:       printString(node); break;
+      case NK_TOPLEVEL:     printToplevel(node); break;
+      case NK_UNARY_PREFIX: printUnaryPrefix(node); break;
+      case NK_VAR:          printVar(node); break;
+      case NK_WHILE:        printWhile(node); break;
       default: {
-        printf("cannot yet print %s\n", type.str);
+        printf("cannot yet print %s\n", node[0]->getCString());
         assert(0);
       }
     }
   }
 
   // print a node, and if nothing is emitted, emit something instead
-  void print(Ref node, const char *otherwise) {
-    int last = used;
+  void print(NodeRef node, const char *otherwise) {
+    size_t last = position();
     print(node);
-    if (used == last) emit(otherwise);
+    if (position() == last) emit(otherwise);
   }
 
-  void printStats(Ref stats) {
+  void printStats(NodeRef stats) {
     bool first = true;
     for (size_t i = 0; i < stats->size(); i++) {
-      Ref curr = stats[i];
+      NodeRef curr = stats[i];
       if (!isNothing(curr)) {
         if (first) first = false;
         else newline();
@@ -738,13 +1046,13 @@ struct JSPrinter {
     }
   }
 
-  void printToplevel(Ref node) {
+  void printToplevel(NodeRef node) {
     if (node[1]->size() > 0) {
       printStats(node[1]);
     }
   }
 
-  void printBlock(Ref node) {
+  void printBlock(NodeRef node) {
     if (node->size() == 1 || node[1]->size() == 0) {
       emit("{}");
       return;
@@ -758,14 +1066,21 @@ struct JSPrinter {
     emit('}');
   }
 
-  void printDefun(Ref node) {
+  void printDefun(NodeRef node) {
+    if (beforeFunction) beforeFunction(node);
+    printFunction(node);
+    if (afterFunction) afterFunction(node);
+    if (out) flush();
+  }
+
+  void printFunction(NodeRef node) {
     emit("function ");
-    emit(node[1]->getCString());
+    emit(node[1]->getIString());
     emit('(');
-    Ref args = node[2];
+    NodeRef args = node[2];
     for (size_t i = 0; i < args->size(); i++) {
       if (i > 0) (pretty ? emit(", ") : emit(','));
-      emit(args[i]->getCString());
+      emit(args[i]->getIString());
     }
     emit(')');
     space();
@@ -783,18 +1098,19 @@ struct JSPrinter {
     newline();
   }
 
-  bool isNothing(Ref node) {
-    return (node[0] == TOPLEVEL && node[1]->size() == 0) || (node[0] == STAT && isNothing(node[1]));
+  bool isNothing(NodeRef node) {
+    NodeKind kind = node->getKind();
+    return (kind == NK_TOPLEVEL && node[1]->size() == 0) || (kind == NK_STAT && isNothing(node[1]));
   }
 
-  void printStat(Ref node) {
+  void printStat(NodeRef node) {
     if (!isNothing(node[1])) {
       print(node[1]);
       if (buffer[used-1] != ';') emit(';');
     }
   }
 
-  void printAssign(Ref node) {
+  void printAssign(NodeRef node) {
     printChild(node[2], node, -1);
     space();
     emit('=');
@@ -802,11 +1118,11 @@ struct JSPrinter {
     printChild(node[3], node, 1);
   }
 
-  void printName(Ref node) {
-    emit(node[1]->getCString());
+  void printName(NodeRef node) {
+    emit(node[1]->getIString());
   }
 
-  void printNum(Ref node) {
+  void printNum(NodeRef node) {
     double d = node[1]->getNumber();
     bool neg = d < 0;
     if (neg) d = -d;
@@ -922,39 +1238,34 @@ struct JSPrinter {
     }
   }
 
-  void printString(Ref node) {
+  void printString(NodeRef node) {
     emit('"');
-    emit(node[1]->getCString());
+    emit(node[1]->getIString());
     emit('"');
   }
 
   // Parens optimizing
 
-  bool capturesOperators(Ref node) {
-    Ref type = node[0];
-    return type == CALL || type == ARRAY || type == OBJECT || type == SEQ;
-  }
-
-  int getPrecedence(Ref node, bool parent) {
-    Ref type = node[0];
-    if (type == BINARY || type == UNARY_PREFIX) {
-      return OperatorClass::getPrecedence(type == BINARY ? OperatorClass::Binary : OperatorClass::Prefix, node[1]->getIString());
-    } else if (type == SEQ) {
-      return OperatorClass::getPrecedence(OperatorClass::Binary, COMMA);
-    } else if (type == CALL) {
-      return parent ? OperatorClass::getPrecedence(OperatorClass::Binary, COMMA) : -1; // call arguments are split by commas, but call itself is safe
-    } else if (type == ASSIGN) {
-      return OperatorClass::getPrecedence(OperatorClass::Binary, SET);
-    } else if (type == CONDITIONAL) {
-      return OperatorClass::getPrecedence(OperatorClass::Tertiary, QUESTION);
+  bool capturesOperators(NodeRef node) {
+    NodeKind kind = node->getKind();
+    return kind == NK_CALL || kind == NK_ARRAY || kind == NK_OBJECT || kind == NK_SEQ;
+  }
+
+  int getPrecedence(NodeRef node, bool parent) {
+    switch (node->getKind()) {
+      case NK_BINARY:       return OperatorClass::getPrecedence(OperatorClass::Binary, node[1]->getIString());
+      case NK_UNARY_PREFIX: return OperatorClass::getPrecedence(OperatorClass::Prefix, node[1]->getIString());
+      case NK_SEQ:          return OperatorClass::getPrecedence(OperatorClass::Binary, COMMA);
+      case NK_CALL:         return parent ? OperatorClass::getPrecedence(OperatorClass::Binary, COMMA) : -1; // call arguments are split by commas, but call itself is safe
+      case NK_ASSIGN:       return OperatorClass::getPrecedence(OperatorClass::Binary, SET);
+      case NK_CONDITIONAL:  return OperatorClass::getPrecedence(OperatorClass::Tertiary, QUESTION);
+      default:              return -1; // otherwise, this is something that fixes precedence explicitly, and we can ignore. XXX
     }
-    // otherwise, this is something that fixes precedence explicitly, and we can ignore
-    return -1; // XXX
   }
 
   // check whether we need parens for the child, when rendered in the parent
   // @param childPosition -1 means it is printed to the left of parent, 0 means "anywhere", 1 means right
-  bool needParens(Ref parent, Ref child, int childPosition) {
+  bool needParens(NodeRef parent, NodeRef child, int childPosition) {
     int parentPrecedence = getPrecedence(parent, true);
     int childPrecedence = getPrecedence(child, false);
 
@@ -962,9 +1273,10 @@ struct JSPrinter {
     if (childPrecedence < parentPrecedence) return false; //          definitely cool
     // equal precedence, so associativity (rtl/ltr) is what matters
     // (except for some exceptions, where multiple operators can combine into confusion)
-    if (parent[0] == UNARY_PREFIX) {
-      assert(child[0] == UNARY_PREFIX);
-      if ((parent[1] == PLUS || parent[1] == MINUS) && child[1] == parent[1]) {
+    if (parent->getKind() == NK_UNARY_PREFIX) {
+      assert(child->getKind() == NK_UNARY_PREFIX);
+      NodeOp op = parent->getOp();
+      if ((op == OP_PLUS || op == OP_MINUS) && child->getOp() == op) {
         // cannot emit ++x when we mean +(+x)
         return true;
       }
@@ -976,24 +1288,26 @@ struct JSPrinter {
     else return childPosition > 0;
   }
 
-  void printChild(Ref child, Ref parent, int childPosition=0) {
+  void printChild(NodeRef child, NodeRef parent, int childPosition=0) {
     bool parens = needParens(parent, child, childPosition);
     if (parens) emit('(');
     print(child);
     if (parens) emit(')');
   }
 
-  void printBinary(Ref node) {
+  void printBinary(NodeRef node) {
     printChild(node[2], node, -1);
     space();
-    emit(node[1]->getCString());
+    emit(node[1]->getIString());
     space();
     printChild(node[3], node, 1);
   }
 
-  void printUnaryPrefix(Ref node) {
-    if (finalize && node[1] == PLUS && (node[2][0] == NUM ||
-                                       (node[2][0] == UNARY_PREFIX && node[2][1] == MINUS && node[2][2][0] == NUM))) {
+  void printUnaryPrefix(NodeRef node) {
+    NodeRef value = node[2];
+    if (finalize && node->getOp() == OP_PLUS && (value->getKind() == NK_NUM ||
+                                                (value->getKind() == NK_UNARY_PREFIX && value->getOp() == OP_MINUS &&
+                                                 value[2]->getKind() == NK_NUM))) {
       // emit a finalized number
       int last = used;
       print(node[2]);
@@ -1018,15 +1332,15 @@ struct JSPrinter {
       used += 2;
       return;
     }
-    if ((buffer[used-1] == '-' && node[1] == MINUS) ||
-        (buffer[used-1] == '+' && node[1] == PLUS)) {
+    if ((buffer[used-1] == '-' && node->getOp() == OP_MINUS) ||
+        (buffer[used-1] == '+' && node->getOp() == OP_PLUS)) {
       emit(' '); // cannot join - and - to --, looks like the -- operator
     }
-    emit(node[1]->getCString());
+    emit(node[1]->getIString());
     printChild(node[2], node, 1);
   }
 
-  void printConditional(Ref node) {
+  void printConditional(NodeRef node) {
     printChild(node[1], node, -1);
     space();
     emit('?');
@@ -1038,10 +1352,10 @@ struct JSPrinter {
     printChild(node[3], node, 1);
   }
 
-  void printCall(Ref node) {
+  void printCall(NodeRef node) {
     printChild(node[1], node, 0);
     emit('(');
-    Ref args = node[2];
+    NodeRef args = node[2];
     for (size_t i = 0; i < args->size(); i++) {
       if (i > 0) (pretty ? emit(", ") : emit(','));
       printChild(args[i], node, 0);
@@ -1049,20 +1363,20 @@ struct JSPrinter {
     emit(')');
   }
 
-  void printSeq(Ref node) {
+  void printSeq(NodeRef node) {
     printChild(node[1], node, -1);
     emit(',');
     space();
     printChild(node[2], node, 1);
   }
 
-  void printDot(Ref node) {
+  void printDot(NodeRef node) {
     print(node[1]);
     emit('.');
-    emit(node[2]->getCString());
+    emit(node[2]->getIString());
   }
 
-  void printSwitch(Ref node) {
+  void printSwitch(NodeRef node) {
     emit("switch");
     space();
     emit('(');
@@ -1071,9 +1385,9 @@ struct JSPrinter {
     space();
     emit('{');
     newline();
-    Ref cases = node[2];
+    NodeRef cases = node[2];
     for (size_t i = 0; i < cases->size(); i++) {
-      Ref c = cases[i];
+      NodeRef c = cases[i];
       if (!c[0]) {
         emit("default:");
       } else {
@@ -1084,10 +1398,10 @@ struct JSPrinter {
       if (c[1]->size() > 0) {
         indent++;
         newline();
-        int curr = used;
+        size_t curr = position();
         printStats(c[1]);
         indent--;
-        if (curr != used) newline();
+        if (curr != position()) newline();
         else used--; // avoid the extra indentation we added tentatively
       } else {
         newline();
@@ -1096,19 +1410,19 @@ struct JSPrinter {
     emit('}');
   }
 
-  void printSub(Ref node) {
+  void printSub(NodeRef node) {
     printChild(node[1], node, -1);
     emit('[');
     print(node[2]);
     emit(']');
   }
 
-  void printVar(Ref node) {
+  void printVar(NodeRef node) {
     emit("var ");
-    Ref args = node[1];
+    NodeRef args = node[1];
     for (size_t i = 0; i < args->size(); i++) {
       if (i > 0) (pretty ? emit(", ") : emit(','));
-      emit(args[i][0]->getCString());
+      emit(args[i][0]->getIString());
       if (args[i]->size() > 1) {
         space();
         emit('=');
@@ -1119,12 +1433,12 @@ struct JSPrinter {
     emit(';');
   }
 
-  static bool ifHasElse(Ref node) {
-    assert(node[0] == IF);
+  static bool ifHasElse(NodeRef node) {
+    assert(node->getKind() == NK_IF);
     return node->size() >= 4 && !!node[3];
   }
 
-  void printIf(Ref node) {
+  void printIf(NodeRef node) {
     emit("if");
     safeSpace();
     emit('(');
@@ -1140,8 +1454,8 @@ struct JSPrinter {
     bool needBraces = false;
     bool hasElse = ifHasElse(node);
     if (hasElse) {
-      Ref child = node[2];
-      while (child[0] == IF) {
+      NodeRef child = node[2];
+      while (child->getKind() == NK_IF) {
         if (!ifHasElse(child)) {
           needBraces = true;
           break;
@@ -1168,7 +1482,7 @@ struct JSPrinter {
     }
   }
 
-  void printDo(Ref node) {
+  void printDo(NodeRef node) {
     emit("do");
     safeSpace();
     print(node[2], "{}");
@@ -1181,7 +1495,7 @@ struct JSPrinter {
     emit(';');
   }
 
-  void printWhile(Ref node) {
+  void printWhile(NodeRef node) {
     emit("while");
     space();
     emit('(');
@@ -1191,15 +1505,15 @@ struct JSPrinter {
     print(node[2], "{}");
   }
 
-  void printLabel(Ref node) {
-    emit(node[1]->getCString());
+  void printLabel(NodeRef node) {
+    emit(node[1]->getIString());
     space();
     emit(':');
     space();
     print(node[2]);
   }
 
-  void printReturn(Ref node) {
+  void printReturn(NodeRef node) {
     emit("return");
     if (!!node[1]) {
       emit(' ');
@@ -1208,32 +1522,32 @@ struct JSPrinter {
     emit(';');
   }
 
-  void printBreak(Ref node) {
+  void printBreak(NodeRef node) {
     emit("break");
     if (!!node[1]) {
       emit(' ');
-      emit(node[1]->getCString());
+      emit(node[1]->getIString());
     }
     emit(';');
   }
 
-  void printContinue(Ref node) {
+  void printContinue(NodeRef node) {
     emit("continue");
     if (!!node[1]) {
       emit(' ');
-      emit(node[1]->getCString());
+      emit(node[1]->getIString());
     }
     emit(';');
   }
 
-  void printNew(Ref node) {
+  void printNew(NodeRef node) {
     emit("new ");
     print(node[1]);
   }
 
-  void printArray(Ref node) {
+  void printArray(NodeRef node) {
     emit('[');
-    Ref args = node[1];
+    NodeRef args = node[1];
     for (size_t i = 0; i < args->size(); i++) {
       if (i > 0) (pretty ? emit(", ") : emit(','));
       print(args[i]);
@@ -1241,18 +1555,18 @@ struct JSPrinter {
     emit(']');
   }
 
-  void printObject(Ref node) {
+  void printObject(NodeRef node) {
     emit('{');
     indent++;
     newline();
-    Ref args = node[1];
+    NodeRef args = node[1];
     for (size_t i = 0; i < args->size(); i++) {
       if (i > 0) {
         pretty ? emit(", ") : emit(',');
         newline();
       }
       emit('"');
-      emit(args[i][0]->getCString());
+      emit(args[i][0]->getIString());
       emit("\":");
       space();
       print(args[i][1]);
@@ -1263,75 +1577,74 @@ struct JSPrinter {
   }
 };
 
+typedef BasicJSPrinter<Ref> JSPrinter;
+
 // cashew builder
 
 class ValueBuilder {
-  static IStringSet statable;
-
   static Ref makeRawString(const IString& s) {
-    return &arena.alloc()->setString(s);
+    return &Arena::current().alloc()->setString(s);
   }
 
-  static Ref makeRawArray() {
-    return &arena.alloc()->setArray();
+  static Ref makeRawArray(int capacity=0) {
+    return &Arena::current().alloc()->setArray(capacity);
   }
 
   static Ref makeNull() {
-    return &arena.alloc()->setNull();
+    return &Arena::current().alloc()->setNull();
+  }
+
+  // A node of a kind, with room for capacity elements. Its node[0] is the tag that all nodes of that kind
+  // share
+  static Ref makeNode(NodeKind kind, int capacity) {
+    Ref ret = makeRawArray(capacity);
+    ret->kind = kind;
+    return &ret->push_back(&nodeTags[kind]);
   }
 
 public:
   static Ref makeToplevel() {
-    return &makeRawArray()->push_back(makeRawString(TOPLEVEL))
-                           .push_back(makeRawArray());
+    return &makeNode(NK_TOPLEVEL, 2)->push_back(makeRawArray());
   }
 
   static Ref makeString(IString str) {
-    return &makeRawArray()->push_back(makeRawString(STRING))
-                           .push_back(makeRawString(str));
+    return &makeNode(NK_STRING, 2)->push_back(makeRawString(str));
   }
 
   static Ref makeBlock() {
-    return &makeRawArray()->push_back(makeRawString(BLOCK))
-                           .push_back(makeRawArray());
+    return &makeNode(NK_BLOCK, 2)->push_back(makeRawArray());
   }
 
   static Ref makeName(IString name) {
-    return &makeRawArray()->push_back(makeRawString(NAME))
-                           .push_back(makeRawString(name));
+    return &makeNode(NK_NAME, 2)->push_back(makeRawString(name));
   }
 
   static void appendToBlock(Ref block, Ref element) {
-    if (block[0] == BLOCK || block[0] == TOPLEVEL) {
-      block[1]->push_back(element);
-    } else if (block[0] == DEFUN) {
-      block[3]->push_back(element);
-    } else assert(0);
+    switch (block->getKind()) {
+      case NK_BLOCK:
+      case NK_TOPLEVEL: block[1]->push_back(element); break;
+      case NK_DEFUN:    block[3]->push_back(element); break;
+      default: assert(0);
+    }
   }
 
   static Ref makeCall(Ref target) {
-    return &makeRawArray()->push_back(makeRawString(CALL))
-                           .push_back(target)
-                           .push_back(makeRawArray());
+    return &makeNode(NK_CALL, 3)->push_back(target)
+                                 .push_back(makeRawArray());
   }
 
   static void appendToCall(Ref call, Ref element) {
-    assert(call[0] == CALL);
+    assert(call->getKind() == NK_CALL);
     call[2]->push_back(element);
   }
 
   static Ref makeStatement(Ref contents) {
-    if (statable.has(contents[0]->getIString())) {
-      return &makeRawArray()->push_back(makeRawString(STAT))
-                             .push_back(contents);
-    } else {
-      return contents; // only very specific things actually need to be stat'ed
-    }
+    if (!needsStatement(contents->getKind())) return contents;
+    return &makeNode(NK_STAT, 2)->push_back(contents);
   }
 
   static Ref makeDouble(double num) {
-    return &makeRawArray()->push_back(makeRawString(NUM))
-                           .push_back(&arena.alloc()->setNumber(num));
+    return &makeNode(NK_NUM, 2)->push_back(&Arena::current().alloc()->setNumber(num));
   }
   static Ref makeInt(uint32_t num) {
     return makeDouble(double(num));
@@ -1339,121 +1652,139 @@ public:
 
   static Ref makeBinary(Ref left, IString op, Ref right) {
     if (op == SET) {
-      return &makeRawArray()->push_back(makeRawString(ASSIGN))
-                             .push_back(&arena.alloc()->setBool(true))
-                             .push_back(left)
-                             .push_back(right);
+      return &makeNode(NK_ASSIGN, 4)->push_back(&Arena::current().alloc()->setBool(true))
+                                     .push_back(left)
+                                     .push_back(right);
     } else if (op == COMMA) {
-      return &makeRawArray()->push_back(makeRawString(SEQ))
-                             .push_back(left)
-                             .push_back(right);
+      return &makeNode(NK_SEQ, 3)->push_back(left)
+                                  .push_back(right);
     } else {
-      return &makeRawArray()->push_back(makeRawString(BINARY))
-                             .push_back(makeRawString(op))
-                             .push_back(left)
-                             .push_back(right);
+      Ref ret = &makeNode(NK_BINARY, 4)->push_back(makeRawString(op))
+                                        .push_back(left)
+                                        .push_back(right);
+      ret->op = getNodeOp(op);
+      return ret;
     }
   }
 
   static Ref makePrefix(IString op, Ref right) {
-    return &makeRawArray()->push_back(makeRawString(UNARY_PREFIX))
-                           .push_back(makeRawString(op))
-                           .push_back(right);
+    Ref ret = &makeNode(NK_UNARY_PREFIX, 3)->push_back(makeRawString(op))
+                                            .push_back(right);
+    ret->op = getNodeOp(op);
+    return ret;
   }
 
   static Ref makeFunction(IString name) {
-    return &makeRawArray()->push_back(makeRawString(DEFUN))
-                           .push_back(makeRawString(name))
-                           .push_back(makeRawArray())
-                           .push_back(makeRawArray());
+    return &makeNode(NK_DEFUN, 4)->push_back(makeRawString(name))
+                                  .push_back(makeRawArray())
+                                  .push_back(makeRawArray());
   }
 
   static void appendArgumentToFunction(Ref func, IString arg) {
-    assert(func[0] == DEFUN);
+    assert(func->getKind() == NK_DEFUN);
     func[2]->push_back(makeRawString(arg));
   }
 
+  static void clearFunctionBody(Ref func) {
+    assert(func->getKind() == NK_DEFUN);
+    func[3]->setArray();
+  }
+
+  // Parsing on several threads has them all allocate from the arena of the thread that started it
+  static const bool buildsInParallel = true;
+  typedef Arena* Allocator;
+  typedef Arena::Use UseAllocator;
+  static Allocator getAllocator() {
+    return &Arena::current();
+  }
+
+  // SourceLocations records nodes by their address
+  static const void* getLocationKey(Ref node) {
+    return node.get();
+  }
+
+  // Called around the parsing of each function body; nothing to do here
+  static void enterFunction(Ref) {}
+  static void exitFunction(Ref) {}
+
+  static void replaceFunction(Ref func, Ref replacement) {
+    assert(func->getKind() == NK_DEFUN && replacement->getKind() == NK_DEFUN);
+    *func = *replacement;
+  }
+
   static Ref makeVar(bool is_const) {
-    return &makeRawArray()->push_back(makeRawString(VAR))
-                           .push_back(makeRawArray());
+    return &makeNode(NK_VAR, 2)->push_back(makeRawArray());
   }
 
   static void appendToVar(Ref var, IString name, Ref value) {
-    assert(var[0] == VAR);
-    Ref array = &makeRawArray()->push_back(makeRawString(name));
+    assert(var->getKind() == NK_VAR);
+    Ref array = &makeRawArray(2)->push_back(makeRawString(name));
     if (!!value) array->push_back(value);
     var[1]->push_back(array);
   }
 
   static Ref makeReturn(Ref value) {
-    return &makeRawArray()->push_back(makeRawString(RETURN)).push_back(!!value ? value : makeNull());
+    return &makeNode(NK_RETURN, 2)->push_back(!!value ? value : makeNull());
   }
 
   static Ref makeIndexing(Ref target, Ref index) {
-    return &makeRawArray()->push_back(makeRawString(SUB))
-                           .push_back(target)
-                           .push_back(index);
+    return &makeNode(NK_SUB, 3)->push_back(target)
+                                .push_back(index);
   }
 
   static Ref makeIf(Ref condition, Ref ifTrue, Ref ifFalse) {
-    return &makeRawArray()->push_back(makeRawString(IF))
-                           .push_back(condition)
-                           .push_back(ifTrue)
-                           .push_back(!!ifFalse ? ifFalse : makeNull());
+    return &makeNode(NK_IF, 4)->push_back(condition)
+                               .push_back(ifTrue)
+                               .push_back(!!ifFalse ? ifFalse : makeNull());
   }
 
   static Ref makeConditional(Ref condition, Ref ifTrue, Ref ifFalse) {
-    return &makeRawArray()->push_back(makeRawString(CONDITIONAL))
-                           .push_back(condition)
-                           .push_back(ifTrue)
-                           .push_back(ifFalse);
+    return &makeNode(NK_CONDITIONAL, 4)->push_back(condition)
+                                        .push_back(ifTrue)
+                                        .push_back(ifFalse);
   }
 
   static Ref makeDo(Ref body, Ref condition) {
-    return &makeRawArray()->push_back(makeRawString(DO))
-                           .push_back(condition)
-                           .push_back(body);
+    return &makeNode(NK_DO, 3)->push_back(condition)
+                               .push_back(body);
   }
 
   static Ref makeWhile(Ref condition, Ref body) {
-    return &makeRawArray()->push_back(makeRawString(WHILE))
-                           .push_back(condition)
-                           .push_back(body);
+    return &makeNode(NK_WHILE, 3)->push_back(condition)
+                                  .push_back(body);
   }
 
   static Ref makeBreak(IString label) {
-    return &makeRawArray()->push_back(makeRawString(BREAK)).push_back(!!label ? makeRawString(label) : makeNull());
+    return &makeNode(NK_BREAK, 2)->push_back(!!label ? makeRawString(label) : makeNull());
   }
 
   static Ref makeContinue(IString label) {
-    return &makeRawArray()->push_back(makeRawString(CONTINUE)).push_back(!!label ? makeRawString(label) : makeNull());
+    return &makeNode(NK_CONTINUE, 2)->push_back(!!label ? makeRawString(label) : makeNull());
   }
 
   static Ref makeLabel(IString name, Ref body) {
-    return &makeRawArray()->push_back(makeRawString(LABEL))
-                           .push_back(makeRawString(name))
-                           .push_back(body);
+    return &makeNode(NK_LABEL, 3)->push_back(makeRawString(name))
+                                  .push_back(body);
   }
 
   static Ref makeSwitch(Ref input) {
-    return &makeRawArray()->push_back(makeRawString(SWITCH))
-                           .push_back(input)
-                           .push_back(makeRawArray());
+    return &makeNode(NK_SWITCH, 3)->push_back(input)
+                                   .push_back(makeRawArray());
   }
 
   static void appendCaseToSwitch(Ref switch_, Ref arg) {
-    assert(switch_[0] == SWITCH);
-    switch_[2]->push_back(&makeRawArray()->push_back(arg).push_back(makeRawArray()));
+    assert(switch_->getKind() == NK_SWITCH);
+    switch_[2]->push_back(&makeRawArray(2)->push_back(arg).push_back(makeRawArray()));
   }
 
   static void appendDefaultToSwitch(Ref switch_) {
-    assert(switch_[0] == SWITCH);
-    switch_[2]->push_back(&makeRawArray()->push_back(makeNull()).push_back(makeRawArray()));
+    assert(switch_->getKind() == NK_SWITCH);
+    switch_[2]->push_back(&makeRawArray(2)->push_back(makeNull()).push_back(makeRawArray()));
   }
 
   static void appendCodeToSwitch(Ref switch_, Ref code, bool explicitBlock) {
-    assert(switch_[0] == SWITCH);
-    assert(code[0] == BLOCK);
+    assert(switch_->getKind() == NK_SWITCH);
+    assert(code->getKind() == NK_BLOCK);
     if (!explicitBlock) {
       for (size_t i = 0; i < code[1]->size(); i++) {
         switch_[2]->back()->back()->push_back(code[1][i]);
@@ -1464,40 +1795,611 @@ public:
   }
 
   static Ref makeDot(Ref obj, IString key) {
-    return &makeRawArray()->push_back(makeRawString(DOT))
-                           .push_back(obj)
-                           .push_back(makeRawString(key));
+    return &makeNode(NK_DOT, 3)->push_back(obj)
+                                .push_back(makeRawString(key));
   }
 
   static Ref makeDot(Ref obj, Ref key) {
-    assert(key[0] == NAME);
+    assert(key->getKind() == NK_NAME);
     return makeDot(obj, key[1]->getIString());
   }
 
   static Ref makeNew(Ref call) {
-    return &makeRawArray()->push_back(makeRawString(NEW))
-                           .push_back(call);
+    return &makeNode(NK_NEW, 2)->push_back(call);
   }
 
   static Ref makeArray() {
-    return &makeRawArray()->push_back(makeRawString(ARRAY))
-                           .push_back(makeRawArray());
+    return &makeNode(NK_ARRAY, 2)->push_back(makeRawArray());
   }
 
   static void appendToArray(Ref array, Ref element) {
-    assert(array[0] == ARRAY);
+    assert(array->getKind() == NK_ARRAY);
     array[1]->push_back(element);
   }
 
   static Ref makeObject() {
-    return &makeRawArray()->push_back(makeRawString(OBJECT))
-                           .push_back(makeRawArray());
+    return &makeNode(NK_OBJECT, 2)->push_back(makeRawArray());
   }
 
   static void appendToObject(Ref array, IString key, Ref value) {
-    assert(array[0] == OBJECT);
-    array[1]->push_back(&makeRawArray()->push_back(makeRawString(key))
-                                        .push_back(value));
+    assert(array->getKind() == NK_OBJECT);
+    array[1]->push_back(&makeRawArray(2)->push_back(makeRawString(key))
+                                         .push_back(value));
+  }
+};
+
+// A builder that also notes the asm.js type of each expression on its node, as it is built (see
+// getType), from the coercions, literals, heap views and Math_fround/Math_imul calls that asm.js
+// spells its types with. Each function also gets a table of its parameters' and locals' types (see
+// getLocalType), kept as a fifth element of its defun node. Names are typed from the table of the
+// function they are in only, so that the result does not depend on whether functions are parsed in
+// the module, or on their own (in parallel, lazily or streaming): the module's globals are in the
+// module function's table. Otherwise the AST is the same as ValueBuilder builds.
+class TypedValueBuilder : public ValueBuilder {
+  static thread_local std::vector<Ref> functions; // the functions whose bodies are being parsed
+
+  static Ref typed(Ref node, AsmType type) {
+    node->asmType = type;
+    return node;
+  }
+
+public:
+  static AsmType getType(Ref node) {
+    return AsmType(node->asmType);
+  }
+
+  // The type of a parameter or local of a function (for the module function, a global), or ASM_NONE.
+  // Parameters are typed by their coercions at the start of the body.
+  static AsmType getLocalType(Ref func, IString name);
+
+  static Ref makeName(IString name);
+
+  static Ref makeCall(Ref target);
+
+  static Ref makeStatement(Ref contents);
+
+  static Ref makeDouble(double num) {
+    return typed(ValueBuilder::makeDouble(num), ASM_DOUBLE);
+  }
+  static Ref makeInt(uint32_t num) {
+    return typed(ValueBuilder::makeInt(num), ASM_INT);
+  }
+
+  static Ref makeBinary(Ref left, IString op, Ref right);
+
+  static Ref makePrefix(IString op, Ref right);
+
+  static Ref makeFunction(IString name);
+
+  static void appendArgumentToFunction(Ref func, IString arg);
+
+  static void clearFunctionBody(Ref func);
+
+  static void enterFunction(Ref func) {
+    functions.push_back(func);
+  }
+  static void exitFunction(Ref) { // the parser exits the functions it entered, innermost first
+    assert(!functions.empty());
+    functions.pop_back();
+  }
+
+  static void appendToVar(Ref var, IString name, Ref value);
+
+  static Ref makeIndexing(Ref target, Ref index);
+
+  static Ref makeConditional(Ref condition, Ref ifTrue, Ref ifFalse);
+};
+
+// Compact AST. The same tree that ValueBuilder builds, kept in a few flat arrays and linked by 32-bit
+// indices rather than pointers, so that links are half the size, and the whole AST can be moved or
+// copied with memcpy. Strings are kept as their interned ids. A node is a header, whose elements are
+// a range of items after it in the array of items; the tag in node[0] is not stored, as the kind says
+// what it is. An item is its type in its low bits, and an index or a value in the rest.
+// CompactRef is a handle to an item, with the same accessors as Ref, so that the traversals and
+// BasicJSPrinter work on it.
+
+class CompactRef;
+
+class CompactAst {
+public:
+  typedef uint32_t Item;
+
+  enum ItemType {
+    NULL_ITEM = 0,
+    NODE_ITEM,   // an index in nodes
+    STRING_ITEM, // an IString id plus one, or 0 for a null IString
+    INT_ITEM,    // a non-negative integer, in the item itself
+    DOUBLE_ITEM, // an index in numbers, for other numbers
+    BOOL_ITEM
+  };
+
+  static const unsigned TYPE_BITS = 3;
+  static const uint32_t MAX_INDEX = (1u << (32 - TYPE_BITS)) - 1;
+
+  // A node, or one of the arrays that ValueBuilder makes for lists, which have no kind. A node of a
+  // kind has as many elements as it is made with. A list has room for the next power of two of its
+  // size, and when it outgrows that, it moves to the end of items, as arrays in the arena do.
+  struct Node {
+    uint8_t kind, op;
+    uint32_t start, size;
+  };
+
+private:
+  std::vector<Node> nodes;
+  std::vector<Item> items;
+  std::vector<double> numbers;
+
+  static thread_local CompactAst* currentAst;
+
+  static uint32_t capacityOf(uint32_t size) {
+    if (size == 0) return 0;
+    uint32_t ret = 2;
+    while (ret < size) ret *= 2;
+    return ret;
+  }
+
+  static uint32_t checkIndex(size_t index, size_t max) {
+    if (index > max) abort(); // too big to index
+    return uint32_t(index);
   }
+
+  uint32_t allocItems(uint32_t size) {
+    size_t ret = items.size();
+    checkIndex(ret + size, UINT32_MAX);
+    items.resize(ret + size);
+    return uint32_t(ret);
+  }
+
+public:
+  static Item makeItem(ItemType type, uint32_t index) {
+    return (index << TYPE_BITS) | type;
+  }
+  static ItemType getType(Item item) {
+    return ItemType(item & ((1 << TYPE_BITS) - 1));
+  }
+  static uint32_t getIndex(Item item) {
+    return item >> TYPE_BITS;
+  }
+
+  Item makeString(IString str) {
+    return makeItem(STRING_ITEM, !!str ? checkIndex(size_t(str.id()) + 1, MAX_INDEX) : 0);
+  }
+  Item makeNumber(double num) {
+    if (num >= 0 && num <= MAX_INDEX && num == double(uint32_t(num)) && !signbit(num)) {
+      return makeItem(INT_ITEM, uint32_t(num));
+    }
+    numbers.push_back(num);
+    return makeItem(DOUBLE_ITEM, checkIndex(numbers.size() - 1, MAX_INDEX));
+  }
+  static Item makeBool(bool b) {
+    return makeItem(BOOL_ITEM, b);
+  }
+
+  // A node of a kind, or a list if NK_OTHER
+  Item makeNode(NodeKind kind, std::initializer_list<Item> elements) {
+    Node node;
+    node.kind = kind;
+    node.op = OP_OTHER;
+    node.size = uint32_t(elements.size());
+    node.start = allocItems(kind == NK_OTHER ? capacityOf(node.size) : node.size);
+    std::copy(elements.begin(), elements.end(), items.begin() + node.start);
+    nodes.push_back(node);
+    return makeItem(NODE_ITEM, checkIndex(nodes.size() - 1, MAX_INDEX));
+  }
+
+  Node& getNode(Item item) {
+    assert(getType(item) == NODE_ITEM);
+    return nodes[getIndex(item)];
+  }
+  Item getElement(Item item, uint32_t i) {
+    Node& node = getNode(item);
+    assert(i < node.size);
+    return items[node.start + i];
+  }
+
+  void append(Item list, Item element) {
+    Node* node = &getNode(list);
+    assert(node->kind == NK_OTHER);
+    if (node->size == capacityOf(node->size)) {
+      uint32_t capacity = capacityOf(node->size + 1);
+      if (node->start + node->size == items.size()) {
+        allocItems(capacity - node->size); // it is last, so it can grow where it is
+      } else {
+        uint32_t start = allocItems(capacity);
+        node = &getNode(list);
+        std::copy(items.begin() + node->start, items.begin() + node->start + node->size, items.begin() + start);
+        node->start = start;
+      }
+    }
+    items[node->start + node->size++] = element;
+  }
+
+  IString getIString(Item item) {
+    assert(getType(item) == STRING_ITEM);
+    return getIndex(item) ? IString::fromId(getIndex(item) - 1) : IString();
+  }
+  double getNumber(Item item) {
+    assert(getType(item) == INT_ITEM || getType(item) == DOUBLE_ITEM);
+    return getType(item) == INT_ITEM ? double(getIndex(item)) : numbers[getIndex(item)];
+  }
+
+  // Frees all the nodes
+  void clear();
+
+  // The number of nodes and lists, and the bytes that they take
+  size_t numNodes() { return nodes.size(); }
+  size_t bytes() {
+    return nodes.size() * sizeof(Node) + items.size() * sizeof(Item) + numbers.size() * sizeof(double);
+  }
+
+  // The compact AST that CompactBuilder builds into on this thread
+  static CompactAst& current() {
+    assert(currentAst);
+    return *currentAst;
+  }
+
+  // Makes CompactBuilder build into an AST on this thread while in scope
+  class Use {
+    CompactAst* previous;
+
+  public:
+    Use(CompactAst* ast) : previous(currentAst) {
+      currentAst = ast;
+    }
+    ~Use() {
+      currentAst = previous;
+    }
+  };
+};
+
+class CompactRef {
+  CompactAst* ast;
+  CompactAst::Item item;
+
+public:
+  CompactRef(std::nullptr_t=nullptr) : ast(nullptr), item(CompactAst::NULL_ITEM) {}
+  CompactRef(CompactAst* ast, CompactAst::Item item) : ast(ast), item(item) {}
+
+  CompactAst* getAst() { return ast; }
+  CompactAst::Item getItem() { return item; }
+
+  // node->size() and the like read as they do on a Ref
+  CompactRef* operator->() { return this; }
+
+  CompactRef operator[](unsigned x) {
+    CompactAst::Node& node = ast->getNode(item);
+    if (node.kind != NK_OTHER) {
+      if (x == 0) return CompactRef(ast, ast->makeString(nodeTags[node.kind].getIString()));
+      x--;
+    }
+    return CompactRef(ast, ast->getElement(item, x));
+  }
+
+  bool operator!() { return isNull(); }
+
+  bool isString() { return CompactAst::getType(item) == CompactAst::STRING_ITEM; }
+  bool isNumber() { return CompactAst::getType(item) == CompactAst::INT_ITEM || CompactAst::getType(item) == CompactAst::DOUBLE_ITEM; }
+  bool isArray()  { return CompactAst::getType(item) == CompactAst::NODE_ITEM; }
+  bool isNull()   { return CompactAst::getType(item) == CompactAst::NULL_ITEM; }
+  bool isBool()   { return CompactAst::getType(item) == CompactAst::BOOL_ITEM; }
+
+  IString getIString() { return ast->getIString(item); }
+  const char* getCString() { return getIString().str; }
+  double getNumber() { return ast->getNumber(item); }
+  bool getBool() {
+    assert(isBool());
+    return CompactAst::getIndex(item);
+  }
+
+  NodeKind getKind() { return isArray() ? NodeKind(ast->getNode(item).kind) : NK_OTHER; }
+  NodeOp getOp() { return isArray() ? NodeOp(ast->getNode(item).op) : OP_OTHER; }
+
+  unsigned size() {
+    CompactAst::Node& node = ast->getNode(item);
+    return node.size + (node.kind != NK_OTHER);
+  }
+  CompactRef back() { return (*this)[size() - 1]; }
+
+  // The same tree as Values, as ValueBuilder would have built it, in the current arena
+  Ref toValue();
+};
+
+// Traversals of compact ASTs, as above
+void traversePre(CompactRef node, std::function<void (CompactRef)> visit);
+void traversePrePost(CompactRef node, std::function<void (CompactRef)> visitPre, std::function<void (CompactRef)> visitPost);
+void traversePrePostConditional(CompactRef node, std::function<bool (CompactRef)> visitPre, std::function<void (CompactRef)> visitPost);
+void traverseFunctions(CompactRef ast, std::function<void (CompactRef)> visit);
+
+// Builds a compact AST, in the one in use on this thread (see CompactAst::Use)
+class CompactBuilder {
+  typedef CompactAst::Item Item;
+
+  static CompactRef makeNode(NodeKind kind, std::initializer_list<Item> elements) {
+    CompactAst& ast = CompactAst::current();
+    return CompactRef(&ast, ast.makeNode(kind, elements));
+  }
+
+  static Item makeList() {
+    return CompactAst::current().makeNode(NK_OTHER, {});
+  }
+
+  static Item makeRawString(IString str) {
+    return CompactAst::current().makeString(str);
+  }
+
+  static void append(CompactRef list, CompactRef element) {
+    CompactAst::current().append(list.getItem(), element.getItem());
+  }
+
+public:
+  static CompactRef makeToplevel() {
+    return makeNode(NK_TOPLEVEL, { makeList() });
+  }
+
+  static CompactRef makeString(IString str) {
+    return makeNode(NK_STRING, { makeRawString(str) });
+  }
+
+  static CompactRef makeBlock() {
+    return makeNode(NK_BLOCK, { makeList() });
+  }
+
+  static CompactRef makeName(IString name) {
+    return makeNode(NK_NAME, { makeRawString(name) });
+  }
+
+  static void appendToBlock(CompactRef block, CompactRef element) {
+    switch (block->getKind()) {
+      case NK_BLOCK:
+      case NK_TOPLEVEL: append(block[1], element); break;
+      case NK_DEFUN:    append(block[3], element); break;
+      default: assert(0);
+    }
+  }
+
+  static CompactRef makeCall(CompactRef target) {
+    return makeNode(NK_CALL, { target.getItem(), makeList() });
+  }
+
+  static void appendToCall(CompactRef call, CompactRef element) {
+    assert(call->getKind() == NK_CALL);
+    append(call[2], element);
+  }
+
+  static CompactRef makeStatement(CompactRef contents) {
+    if (!needsStatement(contents->getKind())) return contents;
+    return makeNode(NK_STAT, { contents.getItem() });
+  }
+
+  static CompactRef makeDouble(double num) {
+    return makeNode(NK_NUM, { CompactAst::current().makeNumber(num) });
+  }
+  static CompactRef makeInt(uint32_t num) {
+    return makeDouble(double(num));
+  }
+
+  static CompactRef makeBinary(CompactRef left, IString op, CompactRef right) {
+    if (op == SET) {
+      return makeNode(NK_ASSIGN, { CompactAst::makeBool(true), left.getItem(), right.getItem() });
+    } else if (op == COMMA) {
+      return makeNode(NK_SEQ, { left.getItem(), right.getItem() });
+    } else {
+      CompactRef ret = makeNode(NK_BINARY, { makeRawString(op), left.getItem(), right.getItem() });
+      CompactAst::current().getNode(ret.getItem()).op = getNodeOp(op);
+      return ret;
+    }
+  }
+
+  static CompactRef makePrefix(IString op, CompactRef right) {
+    CompactRef ret = makeNode(NK_UNARY_PREFIX, { makeRawString(op), right.getItem() });
+    CompactAst::current().getNode(ret.getItem()).op = getNodeOp(op);
+    return ret;
+  }
+
+  static CompactRef makeFunction(IString name) {
+    return makeNode(NK_DEFUN, { makeRawString(name), makeList(), makeList() });
+  }
+
+  static void appendArgumentToFunction(CompactRef func, IString arg) {
+    assert(func->getKind() == NK_DEFUN);
+    CompactAst::current().append(func[2].getItem(), makeRawString(arg));
+  }
+
+  static void clearFunctionBody(CompactRef func) {
+    assert(func->getKind() == NK_DEFUN);
+    CompactAst::current().getNode(func[3].getItem()).size = 0;
+  }
+
+  // A compact AST is built on one thread, so parseToplevelParallel parses on just the one it is called on
+  static const bool buildsInParallel = false;
+  typedef CompactAst* Allocator;
+  struct UseAllocator {
+    explicit UseAllocator(Allocator) {}
+  };
+  static Allocator getAllocator() {
+    return &CompactAst::current();
+  }
+
+  // SourceLocations records nodes by their items, which are unique to them
+  static const void* getLocationKey(CompactRef node) {
+    return (const void*)uintptr_t(node.getItem());
+  }
+
+  static void enterFunction(CompactRef) {}
+  static void exitFunction(CompactRef) {}
+
+  static void replaceFunction(CompactRef func, CompactRef replacement) {
+    assert(func->getKind() == NK_DEFUN && replacement->getKind() == NK_DEFUN);
+    CompactAst& ast = CompactAst::current();
+    ast.getNode(func.getItem()) = ast.getNode(replacement.getItem());
+  }
+
+  static CompactRef makeVar(bool /* is_const */) {
+    return makeNode(NK_VAR, { makeList() });
+  }
+
+  static void appendToVar(CompactRef var, IString name, CompactRef value) {
+    assert(var->getKind() == NK_VAR);
+    CompactAst& ast = CompactAst::current();
+    Item entry = !!value ? ast.makeNode(NK_OTHER, { makeRawString(name), value.getItem() })
+                         : ast.makeNode(NK_OTHER, { makeRawString(name) });
+    ast.append(var[1].getItem(), entry);
+  }
+
+  static CompactRef makeReturn(CompactRef value) {
+    return makeNode(NK_RETURN, { value.getItem() });
+  }
+
+  static CompactRef makeIndexing(CompactRef target, CompactRef index) {
+    return makeNode(NK_SUB, { target.getItem(), index.getItem() });
+  }
+
+  static CompactRef makeIf(CompactRef condition, CompactRef ifTrue, CompactRef ifFalse) {
+    return makeNode(NK_IF, { condition.getItem(), ifTrue.getItem(), ifFalse.getItem() });
+  }
+
+  static CompactRef makeConditional(CompactRef condition, CompactRef ifTrue, CompactRef ifFalse) {
+    return makeNode(NK_CONDITIONAL, { condition.getItem(), ifTrue.getItem(), ifFalse.getItem() });
+  }
+
+  static CompactRef makeDo(CompactRef body, CompactRef condition) {
+    return makeNode(NK_DO, { condition.getItem(), body.getItem() });
+  }
+
+  static CompactRef makeWhile(CompactRef condition, CompactRef body) {
+    return makeNode(NK_WHILE, { condition.getItem(), body.getItem() });
+  }
+
+  static CompactRef makeBreak(IString label) {
+    return makeNode(NK_BREAK, { !!label ? makeRawString(label) : Item(CompactAst::NULL_ITEM) });
+  }
+
+  static CompactRef makeContinue(IString label) {
+    return makeNode(NK_CONTINUE, { !!label ? makeRawString(label) : Item(CompactAst::NULL_ITEM) });
+  }
+
+  static CompactRef makeLabel(IString name, CompactRef body) {
+    return makeNode(NK_LABEL, { makeRawString(name), body.getItem() });
+  }
+
+  static CompactRef makeSwitch(CompactRef input) {
+    return makeNode(NK_SWITCH, { input.getItem(), makeList() });
+  }
+
+  static void appendCaseToSwitch(CompactRef switch_, CompactRef arg) {
+    assert(switch_->getKind() == NK_SWITCH);
+    CompactAst& ast = CompactAst::current();
+    ast.append(switch_[2].getItem(), ast.makeNode(NK_OTHER, { arg.getItem(), makeList() }));
+  }
+
+  static void appendDefaultToSwitch(CompactRef switch_) {
+    appendCaseToSwitch(switch_, nullptr);
+  }
+
+  static void appendCodeToSwitch(CompactRef switch_, CompactRef code, bool explicitBlock) {
+    assert(switch_->getKind() == NK_SWITCH);
+    assert(code->getKind() == NK_BLOCK);
+    CompactRef last = switch_[2]->back()->back();
+    if (!explicitBlock) {
+      for (size_t i = 0; i < code[1]->size(); i++) {
+        append(last, code[1][i]);
+      }
+    } else {
+      append(last, code);
+    }
+  }
+
+  static CompactRef makeDot(CompactRef obj, IString key) {
+    return makeNode(NK_DOT, { obj.getItem(), makeRawString(key) });
+  }
+
+  static CompactRef makeDot(CompactRef obj, CompactRef key) {
+    assert(key->getKind() == NK_NAME);
+    return makeDot(obj, key[1]->getIString());
+  }
+
+  static CompactRef makeNew(CompactRef call) {
+    return makeNode(NK_NEW, { call.getItem() });
+  }
+
+  static CompactRef makeArray() {
+    return makeNode(NK_ARRAY, { makeList() });
+  }
+
+  static void appendToArray(CompactRef array, CompactRef element) {
+    assert(array->getKind() == NK_ARRAY);
+    append(array[1], element);
+  }
+
+  static CompactRef makeObject() {
+    return makeNode(NK_OBJECT, { makeList() });
+  }
+
+  static void appendToObject(CompactRef array, IString key, CompactRef value) {
+    assert(array->getKind() == NK_OBJECT);
+    CompactAst& ast = CompactAst::current();
+    ast.append(array[1].getItem(), ast.makeNode(NK_OTHER, { makeRawString(key), value.getItem() }));
+  }
+};
+
+// Flat AST. A tree laid out in preorder as a struct of arrays, so that a full traversal is a scan
+// along them: each entry, that is each node, list and value, has a kind, a payload and the size of
+// its subtree, in entries, including itself. The children of an entry follow it, each after the
+// subtree of the one before it. The parser builds nodes before their parents, and adds to lists
+// after it made them, so a flat AST is not built while parsing, but laid out from a compact AST
+// after, in one pass.
+
+class FlatAst {
+public:
+  // What an entry is, if it is not a node of a NodeKind, whose payload is its NodeOp
+  enum {
+    FLAT_LIST = NUM_NODE_KINDS,
+    FLAT_STRING, // an IString id plus one, or 0 for a null IString
+    FLAT_INT,    // a non-negative integer
+    FLAT_DOUBLE, // an index in numbers, for other numbers
+    FLAT_NULL,
+    FLAT_BOOL
+  };
+
+  std::vector<uint8_t> kinds;
+  std::vector<uint32_t> payloads;
+  std::vector<uint32_t> sizes;
+  std::vector<double> numbers;
+
+  // Lays out the tree under root, replacing what was here
+  void assign(CompactRef root);
+
+  void clear();
+
+  size_t size() { return kinds.size(); }
+  size_t bytes() {
+    return kinds.size() * sizeof(uint8_t) + payloads.size() * sizeof(uint32_t) + sizes.size() * sizeof(uint32_t) +
+           numbers.size() * sizeof(double);
+  }
+
+  // The entry after all of an entry's subtree, which is its next sibling, if it has one
+  uint32_t next(uint32_t i) { return i + sizes[i]; }
+
+  bool isNode(uint32_t i) { return kinds[i] < NUM_NODE_KINDS; }
+  NodeKind getKind(uint32_t i) { return isNode(i) ? NodeKind(kinds[i]) : NK_OTHER; }
+  NodeOp getOp(uint32_t i) { return isNode(i) ? NodeOp(payloads[i]) : OP_OTHER; }
+  IString getIString(uint32_t i) {
+    assert(kinds[i] == FLAT_STRING);
+    return payloads[i] ? IString::fromId(payloads[i] - 1) : IString();
+  }
+  double getNumber(uint32_t i) {
+    assert(kinds[i] == FLAT_INT || kinds[i] == FLAT_DOUBLE);
+    return kinds[i] == FLAT_INT ? double(payloads[i]) : numbers[payloads[i]];
+  }
+
+  // The same tree as Values, as ValueBuilder would have built it, in the current arena
+  Ref toValue(uint32_t i=0);
 };
 
+// Prints a script as JS one function at a time, for scripts too big to have all of their AST in memory
+// at once. Functions are parsed lazily, then each is parsed right before it is printed, passed to
+// transform if there is one, and freed after. transform must only change the body of the function it
+// is given.
+// Returns the first error in the script, if it has one, in which case the output is not complete.
+ParseError printIncrementally(const char *src, bool pretty, bool finalize, std::ostream& out,
+                              std::function<void (Ref)> transform=nullptr);
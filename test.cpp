@@ -1,21 +1,498 @@
 
+#include <pthread.h>
+
+#include <sstream>
+
 #include "simple_ast.h"
 
+struct Parse {
+  const char *src;
+  Arena *arena; // to build in, as the thread's own is freed when it exits
+  Ref ast;
+  cashew::ParseError error;
+};
+
+static void* parseOnThread(void* arg) {
+  Parse *parse = (Parse*)arg;
+  Arena::Use use(parse->arena);
+  cashew::Parser<Ref, ValueBuilder> parser;
+  parse->ast = parser.parseToplevel(parse->src);
+  parse->error = parser.getError();
+  return nullptr;
+}
+
+// Checks that are made in release builds too, unlike asserts. A failed one ends the run
+#define CHECK(x) do { if (!(x)) { printf("check failed at line %d: %s\n", __LINE__, #x); exit(1); } } while (0)
+
+// Interned strings, their ids, and the tables indexed by them
+static int testIStrings() {
+  // enough strings that their ids span several chunks
+  std::vector<IString> strings;
+  for (int i = 0; i < 5000; i++) strings.push_back(IString(("istring" + std::to_string(i)).c_str()));
+  for (IString str : strings) CHECK(IString::fromId(str.id()) == str);
+
+  // lookups of ids that the tables have no room for yet
+  IStringBitSet set;
+  IStringMap<int> map;
+  CHECK(!set.has(strings.back()) && !map.has(strings.back()) && !map.find(strings.back()));
+
+  for (size_t i = 0; i < strings.size(); i += 3) {
+    set.insert(strings[i]);
+    map[strings[i]] = int(i);
+  }
+  for (size_t i = 0; i < strings.size(); i++) {
+    CHECK(set.has(strings[i]) == (i % 3 == 0));
+    CHECK(map.has(strings[i]) == (i % 3 == 0));
+    int *value = map.find(strings[i]);
+    CHECK(i % 3 ? !value : value && *value == int(i));
+  }
+
+  // erasing, including what is not there
+  set.erase(strings[3]);
+  set.erase(strings[4]);
+  map.erase(strings[3]);
+  map.erase(strings[4]);
+  CHECK(!set.has(strings[3]) && !set.has(strings[4]) && set.has(strings[6]));
+  CHECK(!map.has(strings[3]) && !map.find(strings[4]) && *map.find(strings[6]) == 6);
+
+  // forEach visits what is there, in id order
+  size_t expected = (strings.size() + 2) / 3 - 1, count = 0;
+  IString previous;
+  set.forEach([&](IString str) {
+    CHECK(!previous || previous.id() < str.id());
+    CHECK(str != strings[3]);
+    previous = str;
+    count++;
+  });
+  CHECK(count == expected);
+  count = 0;
+  map.forEach([&](IString str, int& value) {
+    CHECK(strings[value] == str);
+    count++;
+  });
+  CHECK(count == expected);
+
+  // an erased value is gone, and so is everything after clearing
+  CHECK(map[strings[3]] == 0);
+  set.clear();
+  map.clear();
+  CHECK(!set.has(strings[0]) && !map.has(strings[0]));
+
+  // a string interned after the tables grew
+  IString later("istring-later");
+  CHECK(!set.has(later) && !map.has(later));
+  set.insert(later);
+  map[later] = 7;
+  CHECK(set.has(later) && *map.find(later) == 7);
+
+  // strings in the permanent table are shared by pools, and ones a pool got first stay its own
+  IString permanent("istring-permanent"), pooled;
+  IStringPool pool;
+  {
+    IStringPool::Use use(pool);
+    CHECK(IStringPool::current() == &pool);
+    CHECK(IString("istring-permanent") == permanent);
+    pooled = IString("istring-pooled");
+  }
+  CHECK(!IStringPool::current());
+  CHECK(IString("istring-pooled") != pooled);
+  {
+    IStringPool::Use use(pool);
+    CHECK(IString("istring-pooled") == pooled);
+  }
+
+  // uses nest, and nullptr means the permanent table
+  IStringPool inner;
+  {
+    IStringPool::Use outerUse(pool);
+    {
+      IStringPool::Use innerUse(inner);
+      CHECK(IStringPool::current() == &inner);
+      CHECK(IString("istring-pooled") != pooled);
+      {
+        IStringPool::Use permanentUse(nullptr);
+        CHECK(!IStringPool::current());
+        CHECK(IString("istring-permanent") == permanent);
+      }
+      CHECK(IStringPool::current() == &inner);
+    }
+    CHECK(IStringPool::current() == &pool);
+    CHECK(IString("istring-pooled") == pooled);
+  }
+  CHECK(!IStringPool::current());
+
+  // the ids of a destroyed pool's strings are reused
+  uint32_t numIds = IString::numIds();
+  {
+    IStringPool temporary;
+    IStringPool::Use use(temporary);
+    for (int i = 0; i < 100; i++) IString(("istring-temporary" + std::to_string(i)).c_str());
+  }
+  CHECK(IString::numIds() == numIds + 100);
+  {
+    IStringPool temporary;
+    IStringPool::Use use(temporary);
+    for (int i = 0; i < 100; i++) {
+      IString str(("istring-reused" + std::to_string(i)).c_str());
+      CHECK(str.id() >= numIds && IString::fromId(str.id()) == str);
+    }
+  }
+  CHECK(IString::numIds() == numIds + 100);
+
+  printf("ok\n");
+  return 0;
+}
+
+// Node tags, which all nodes of a kind share. Giving a node a new one changes its kind, and no other's
+static int testNodeTags() {
+  cashew::Parser<Ref, ValueBuilder> parser;
+  Ref ast = parser.parseToplevel("x = a + b; y = c - d;");
+  CHECK(!!ast);
+  std::vector<Ref> names, binaries;
+  traversePre(ast, [&](Ref node) {
+    if (node->getKind() == NK_NAME) names.push_back(node);
+    else if (node->getKind() == NK_BINARY) binaries.push_back(node);
+  });
+  CHECK(names.size() == 6 && binaries.size() == 2);
+
+  names[0][0] = &Arena::current().alloc()->setString("string");
+  CHECK(names[0]->getKind() == NK_STRING);
+  for (size_t i = 1; i < names.size(); i++) {
+    CHECK(names[i]->getKind() == NK_NAME && names[i][0]->getIString() == NAME);
+  }
+
+  // a tag that is no kind's makes it no node, so it has no operator either
+  binaries[0][0] = &Arena::current().alloc()->setString("other");
+  CHECK(binaries[0]->getKind() == NK_OTHER && binaries[0]->getOp() == OP_OTHER);
+  CHECK(binaries[1]->getKind() == NK_BINARY && binaries[1]->getOp() == OP_MINUS);
+  CHECK(binaries[1][0]->getIString() == BINARY);
+
+  printf("ok\n");
+  return 0;
+}
+
+// The types TypedValueBuilder notes, in a function that has one of each
+static int testTypes() {
+  cashew::Parser<Ref, TypedValueBuilder> parser;
+  Ref ast = parser.parseToplevel(
+    "function f(x, y) {\n"
+    "  x = x | 0;\n"
+    "  y = +y;\n"
+    "  var i = 1, d = 1.0, g = Math_fround(0);\n"
+    "  i = x >>> 0;\n"
+    "  d = y;\n"
+    "  g = Math_fround(d);\n"
+    "  return +(d + 1.0);\n"
+    "}\n");
+  CHECK(!!ast);
+  Ref func = ast[1][0];
+  auto type = [](Ref node) { return TypedValueBuilder::getType(node); };
+  CHECK(TypedValueBuilder::getLocalType(func, IString("x")) == ASM_INT);
+  CHECK(TypedValueBuilder::getLocalType(func, IString("y")) == ASM_DOUBLE);
+  CHECK(TypedValueBuilder::getLocalType(func, IString("i")) == ASM_INT);
+  CHECK(TypedValueBuilder::getLocalType(func, IString("d")) == ASM_DOUBLE);
+  CHECK(TypedValueBuilder::getLocalType(func, IString("g")) == ASM_FLOAT);
+  CHECK(TypedValueBuilder::getLocalType(func, IString("z")) == ASM_NONE);
+  Ref body = DefunNode(func).body();
+  CHECK(body->size() == 7);
+
+  // coercions type the parameters, and the names assigned to
+  AssignNode coerceX(body[0][1]), coerceY(body[1][1]);
+  CHECK(type(coerceX.value()) == ASM_SIGNED && type(coerceX.target()) == ASM_INT);
+  CHECK(type(coerceY.value()) == ASM_DOUBLE && type(coerceY.target()) == ASM_DOUBLE);
+
+  // literals are ints or doubles by whether they have a dot
+  Ref vars = body[2][1];
+  CHECK(type(vars[0][1]) == ASM_INT && type(vars[1][1]) == ASM_DOUBLE && type(vars[2][1]) == ASM_FLOAT);
+
+  // names have the types of the locals they are of, once those are known
+  AssignNode toI(body[3][1]), toD(body[4][1]), toG(body[5][1]);
+  CHECK(type(toI.value()) == ASM_UNSIGNED && type(BinaryNode(toI.value()).left()) == ASM_INT);
+  CHECK(type(toD.target()) == ASM_DOUBLE && type(toD.value()) == ASM_DOUBLE);
+  CHECK(type(toG.value()) == ASM_FLOAT && type(CallNode(toG.value()).arg(0)) == ASM_DOUBLE);
+
+  UnaryPrefixNode ret(body[6][1]);
+  CHECK(type(ret.node) == ASM_DOUBLE && type(ret.value()) == ASM_DOUBLE);
+  CHECK(type(BinaryNode(ret.value()).right()) == ASM_DOUBLE);
+
+  printf("ok\n");
+  return 0;
+}
+
+// parseNumber against strtod, on literals at the edges of its fast paths
+static int testNumbers() {
+  std::vector<std::string> literals = {
+    // hex, where digits past the first 16 only matter as a sticky bit, for ties
+    "0x0", "0X1aB", "0x1fffffffffffff", "0x20000000000001", "0x20000000000003", "0x10000000000000800",
+    "0x10000000000000801", "0x100000000000008000000000", "0x100000000000008000000001",
+    "0xfffffffffffffffffffffff",
+    // near 2^53, the most the fast path takes as an exact mantissa
+    "9007199254740991", "9007199254740992", "9007199254740993", "9007199254740994", "9007199254740995",
+    "9007199254740993.0", "900719925474099.3e1", "18014398509481985",
+    // more than 19 significant digits, which are truncated
+    "12345678901234567890", "1234567890123456789012345", "0.1234567890123456789012", "0.000000000000000000001",
+    // large, small, and not quite exponents
+    "1e308", "1.7976931348623157e308", "1.7976931348623159e308", "1e400", "4.9e-324", "2e-324", "1e-400",
+    "0e999", "0.000", ".5", "5.", "1e", "1e+", "1ex", "1E5",
+  };
+  // exponents at the edge of the fast path, which scales exactly by powers of ten up to 1e22, and moves
+  // more of a large one into a mantissa with room
+  for (const char *mantissa : { "1", "12", "4.5", "123456789", "4503599627370497", "9007199254740991",
+                                "9007199254740992", "9007199254740993" }) {
+    for (int exponent = -25; exponent <= 40; exponent++) {
+      literals.push_back(std::string(mantissa) + "e" + std::to_string(exponent));
+    }
+  }
+  for (std::string& literal : literals) {
+    const char *src = literal.c_str();
+    char *expectedEnd;
+    double expected = strtod(src, &expectedEnd), actual;
+    bool hasDot;
+    const char *actualEnd = cashew::parseNumber(src, actual, hasDot);
+    if (actualEnd != expectedEnd || memcmp(&actual, &expected, sizeof(double)) != 0 ||
+        hasDot != (strchr(src, '.') != nullptr)) {
+      printf("mismatch on %s: %.17g instead of %.17g\n", src, actual, expected);
+      return 1;
+    }
+  }
+  printf("ok\n");
+  return 0;
+}
+
+static int reportError(const cashew::ParseError& error) {
+  static const char* names[] = { "none", "unexpected end", "bad character", "unexpected token" };
+  std::cout << "error: " << names[error.code] << " at " << error.offset;
+  if (error.expected) std::cout << ", expected " << error.expected;
+  std::cout << "\n";
+  return 1;
+}
+
 int main(int argc, char **argv) {
-  // Read input file
-  FILE *f = fopen(argv[1], "r");
-  assert(f);
-  fseek(f, 0, SEEK_END);
-  int size = ftell(f);
-  char *src = new char[size+1];
-  rewind(f);
-  int num = fread(src, 1, size, f);
-  assert(num == size);
-  fclose(f);
-  src[size] = 0;
+  // Options come first, then the input file and optionally the printing flags
+  bool prelex = false;
+  bool lazy = false;
+  bool incremental = false;
+  bool locations = false;
+  bool reparse = false;
+  bool typed = false;
+  bool ownArena = false;
+  bool compact = false;
+  bool flat = false;
+  int threads = 1;
+  int chunkSize = 0;
+  int stackSize = 0;
+  while (argc > 1 && argv[1][0] == '-' && argv[1][1] == '-') {
+    if (strcmp(argv[1], "--prelex") == 0) prelex = true;
+    else if (strcmp(argv[1], "--lazy") == 0) lazy = true;
+    else if (strcmp(argv[1], "--incremental") == 0) incremental = lazy = true; // only printing JS is incremental
+    else if (strcmp(argv[1], "--locations") == 0) locations = true;
+    else if (strcmp(argv[1], "--reparse") == 0) reparse = true;
+    else if (strcmp(argv[1], "--typed") == 0) typed = true;
+    else if (strcmp(argv[1], "--arena") == 0) ownArena = true;
+    else if (strcmp(argv[1], "--compact") == 0) compact = true;
+    else if (strcmp(argv[1], "--istrings") == 0) return testIStrings();
+    else if (strcmp(argv[1], "--tags") == 0) return testNodeTags();
+    else if (strcmp(argv[1], "--types") == 0) return testTypes();
+    else if (strcmp(argv[1], "--numbers") == 0) return testNumbers();
+    else if (strcmp(argv[1], "--flat") == 0) flat = compact = true;
+    else if (strncmp(argv[1], "--parallel=", 11) == 0) threads = atoi(argv[1] + 11);
+    else if (strncmp(argv[1], "--stream=", 9) == 0) chunkSize = atoi(argv[1] + 9);
+    else if (strncmp(argv[1], "--stack=", 8) == 0) stackSize = atoi(argv[1] + 8); // in KB
+    else assert(0);
+    argc--;
+    argv++;
+  }
+
+  // Map the input file, which is parsed in place
+  cashew::MappedFile file(argv[1]);
+  assert(file.data());
+  const char *src = file.data();
+
+  if (stackSize) {
+    // parse on a thread with a small stack. printing recurses as deep as the AST is, so instead just
+    // count the nodes, which does not
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, stackSize * 1024);
+    pthread_t thread;
+    Parse parse = { src, &Arena::current(), nullptr, cashew::ParseError() };
+    CHECK(pthread_create(&thread, &attr, parseOnThread, &parse) == 0);
+    pthread_join(thread, nullptr);
+    if (!parse.ast) return reportError(parse.error);
+    int nodes = 0;
+    traversePre(parse.ast, [&](Ref) { nodes++; });
+    std::cout << nodes << " nodes\n";
+    return 0;
+  }
+
+  if (incremental && argc > 2) {
+    cashew::ParseError error = printIncrementally(src, argv[2][0] == '1', argv[3][0] == '1', std::cout);
+    std::cout << "\n";
+    if (error.code != cashew::ParseError::NONE) return reportError(error);
+    return 0;
+  }
+
+  // with --arena, the AST is built in an arena of its own, rather than this thread's
+  Arena arena;
+  Arena::Use use(ownArena ? &arena : &Arena::current());
 
   cashew::Parser<Ref, ValueBuilder> builder;
-  Ref ast = builder.parseToplevel(src);
+  Ref ast;
+  cashew::FragStream frags;
+  if (prelex) frags.lex(src);
+  builder.setLazy(lazy);
+  cashew::SourceLocations sourceLocations;
+  if (locations) builder.setLocations(&sourceLocations);
+  std::string edited;
+  if (reparse) {
+    // edit each function in turn, reparsing just that function, and check that the result is what
+    // parsing all of the edited source gives, then undo the edit the same way. last, make an edit that
+    // moves where the first function ends, which parses it all again, and undo that
+    auto print = [](Ref node) {
+      std::ostringstream out;
+      node->stringify(out);
+      return out.str();
+    };
+    auto reparseEdit = [&](uint32_t editStart, uint32_t editEnd, uint32_t newEditEnd, bool inPlace) {
+      Ref reparsed = builder.reparse(ast, edited.c_str(), edited.size(), editStart, editEnd, newEditEnd);
+      CHECK(!!reparsed && (reparsed.get() == ast.get()) == inPlace);
+      ast = reparsed;
+      Ref full = cashew::Parser<Ref, ValueBuilder>().parseToplevel(edited.c_str());
+      CHECK(!!full && print(ast) == print(full));
+    };
+    std::vector<cashew::FunctionSpan> spans = cashew::findFunctions(src);
+    edited.assign(src, file.size());
+    builder.setEditable(true);
+    ast = builder.parseToplevel(edited.c_str());
+    if (!ast) return reportError(builder.getError());
+    const std::string statement = "$reparsed = $reparsed + 1.0;\n";
+    for (auto& span : spans) {
+      uint32_t at = span.end - 1;
+      edited.insert(at, statement);
+      reparseEdit(at, at, at + statement.size(), true);
+      edited.erase(at, statement.size());
+      reparseEdit(at, at + statement.size(), at, true);
+    }
+    if (!spans.empty()) {
+      const std::string split = "}\nfunction $reparsed() {\n";
+      uint32_t at = spans[0].end - 1;
+      edited.insert(at, split);
+      reparseEdit(at, at, at + split.size(), false);
+      edited.erase(at, split.size());
+      reparseEdit(at, at + split.size(), at, false);
+    }
+  } else if (typed) {
+    cashew::Parser<Ref, TypedValueBuilder> typedBuilder;
+    ast = threads != 1 ? typedBuilder.parseToplevelParallel(src, threads) : typedBuilder.parseToplevel(src);
+    if (!ast) return reportError(typedBuilder.getError());
+  } else if (compact) {
+    // build a compact AST, and print that, or for JSON, turn it into Values, which should be the same
+    // nodes. with --flat, lay it out flat, and turn that into Values for either
+    CompactAst compactAst;
+    CompactAst::Use useCompact(&compactAst);
+    cashew::Parser<CompactRef, CompactBuilder> compactBuilder;
+    compactBuilder.setLazy(lazy);
+    // parseToplevelParallel parses it all on this thread, as a compact AST is built on one
+    CompactRef root = threads != 1 ? compactBuilder.parseToplevelParallel(src, threads, prelex ? &frags : nullptr)
+                                   : compactBuilder.parseToplevel(src, prelex ? &frags : nullptr);
+    if (!root || !compactBuilder.materializeAll()) return reportError(compactBuilder.getError());
+    int compactNodes = 0, nodes = 0;
+    if (flat) {
+      // the nodes, and the lists with something in them, are what a traversal visits
+      FlatAst flatAst;
+      flatAst.assign(root);
+      for (uint32_t i = 0; i < flatAst.size(); i++) {
+        if (flatAst.isNode(i) || (flatAst.kinds[i] == FlatAst::FLAT_LIST && flatAst.sizes[i] > 1)) compactNodes++;
+      }
+      ast = flatAst.toValue();
+    } else if (argc > 2) {
+      BasicJSPrinter<CompactRef> jser(argv[2][0] == '1', argv[3][0] == '1', root);
+      jser.printAst();
+      std::cout << jser.buffer << "\n";
+      return 0;
+    } else {
+      traversePre(root, [&](CompactRef) { compactNodes++; });
+      ast = root->toValue();
+    }
+    traversePre(ast, [&](Ref) { nodes++; });
+    CHECK(compactNodes == nodes);
+  } else if (chunkSize) {
+    cashew::StreamingParser<Ref, ValueBuilder> streaming;
+    for (size_t i = 0; i < file.size(); i += chunkSize) {
+      streaming.feed(src + i, std::min(size_t(chunkSize), file.size() - i));
+    }
+    ast = streaming.finish();
+    if (!ast) return reportError(streaming.getError());
+  } else if (threads != 1) {
+    ast = builder.parseToplevelParallel(src, threads, prelex ? &frags : nullptr);
+  } else {
+    ast = builder.parseToplevel(src, prelex ? &frags : nullptr);
+  }
+  if (!ast || !builder.materializeAll()) return reportError(builder.getError());
+
+  if (locations) {
+    // every statement should have been recorded, and every record should be at the start of something
+    auto check = [&](Ref node) {
+      uint32_t offset;
+      CHECK(sourceLocations.find(&*node, offset) && offset < file.size() && !isspace(src[offset]));
+    };
+    check(ast);
+    traversePre(ast, [&](Ref node) {
+      Ref statements;
+      if (node->getKind() == NK_TOPLEVEL || node->getKind() == NK_BLOCK) statements = node[1];
+      else if (node->getKind() == NK_DEFUN) statements = DefunNode(node).body();
+      else return;
+      for (size_t i = 0; i < statements->size(); i++) check(statements[i]);
+    });
+    sourceLocations.forEach([&](const void*, uint32_t offset) {
+      CHECK(offset < file.size() && !isspace(src[offset]));
+    });
+  }
+
+  if (typed) {
+    // coercions and literals should have their types, and names the types of the locals they are of,
+    // once those are known. then drop the tables of locals, which ValueBuilder does not build, so that
+    // the output is the same
+    std::vector<Ref> functions;
+    traversePrePost(ast, [&](Ref node) {
+      AsmType type = TypedValueBuilder::getType(node);
+      switch (node->getKind()) {
+        case NK_DEFUN: functions.push_back(node); break;
+        case NK_BINARY: {
+          if (BinaryNode(node).op() == OP_OR) CHECK(type == ASM_SIGNED);
+          else if (BinaryNode(node).op() == OP_TRSHIFT) CHECK(type == ASM_UNSIGNED);
+          break;
+        }
+        case NK_UNARY_PREFIX: {
+          if (UnaryPrefixNode(node).op() == OP_PLUS) CHECK(type == ASM_DOUBLE);
+          break;
+        }
+        case NK_CALL: {
+          Ref target = CallNode(node).target();
+          if (target->getKind() == NK_NAME && NameNode(target).name() == MATH_FROUND) CHECK(type == ASM_FLOAT);
+          break;
+        }
+        case NK_NUM: {
+          // 1.0 is a double too, which the --types test checks
+          double value = NumNode(node).value();
+          CHECK(type == ASM_DOUBLE || (type == ASM_INT && value == floor(value)));
+          break;
+        }
+        case NK_NAME: {
+          if (!functions.empty()) {
+            CHECK(type == ASM_NONE || type == TypedValueBuilder::getLocalType(functions.back(), NameNode(node).name()));
+          }
+          break;
+        }
+        default: break;
+      }
+    }, [&](Ref node) {
+      if (node->getKind() == NK_DEFUN) {
+        functions.pop_back();
+        node->pop_back();
+      }
+    });
+  }
 
   if (argc == 2) {
     ast->stringify(std::cout, true);
@@ -25,5 +502,11 @@ int main(int argc, char **argv) {
     jser.printAst();
     std::cout << jser.buffer << "\n";
   }
-}
 
+  if (ownArena) {
+    // the AST should all be in it, and be freed by reset
+    CHECK(arena.bytesUsed() > 0 && arena.bytesUsed() <= arena.bytesReserved());
+    arena.reset();
+    CHECK(arena.bytesReserved() == 0 && arena.bytesUsed() == 0);
+  }
+}
@@ -9,21 +9,82 @@ print 'testing'
 for i in os.listdir('../samples'):
   if i.endswith('.js') and i.count('.') == 1:
     for extra in [[], ['1', '0']]:
-      command = ['./cashew', os.path.join('../samples', i)] + extra
-      print ' '.join(command)
-      out, err = Popen(command, stdout=PIPE).communicate()
-      out = out.replace('\n\n', '\n')
-      filename = os.path.join('../samples', i + ('.' if extra else '') + '_'.join(extra) + ('.js' if extra else '.txt'))
-      try:
-        expected = open(filename).read()
-      except:
-        print 'no expected output for:\n', out, filename
-        raise
-      expected = expected.replace('\n\n', '\n')
-      #print out
-      #print '^v'
-      #print expected
-      assert out == expected, ''.join([a.rstrip()+'\n' for a in difflib.unified_diff(expected.split('\n'), out.split('\n'), fromfile='expected', tofile='actual')])
+      for options in [[], ['--prelex'], ['--lazy'], ['--parallel=4'], ['--prelex', '--parallel=4'], ['--lazy', '--parallel=4'], ['--stream=7'], ['--incremental'], ['--locations'], ['--lazy', '--locations'], ['--reparse'], ['--typed'], ['--typed', '--parallel=4'], ['--arena'], ['--arena', '--parallel=4'], ['--compact'], ['--compact', '--lazy'], ['--compact', '--prelex'], ['--compact', '--parallel=4'], ['--flat'], ['--flat', '--lazy']]:
+        command = ['./cashew'] + options + [os.path.join('../samples', i)] + extra
+        print ' '.join(command)
+        out, err = Popen(command, stdout=PIPE).communicate()
+        out = out.replace('\n\n', '\n')
+        filename = os.path.join('../samples', i + ('.' if extra else '') + '_'.join(extra) + ('.js' if extra else '.txt'))
+        try:
+          expected = open(filename).read()
+        except:
+          print 'no expected output for:\n', out, filename
+          raise
+        expected = expected.replace('\n\n', '\n')
+        #print out
+        #print '^v'
+        #print expected
+        assert out == expected, ''.join([a.rstrip()+'\n' for a in difflib.unified_diff(expected.split('\n'), out.split('\n'), fromfile='expected', tofile='actual')])
+
+print 'stress testing on a small stack'
+
+N = 1000000
+for name, js, nodes in [
+    ('sequence', 'x = ' + ', '.join('a%d' % i for i in range(N)) + ';', 2*N + 4),
+    ('assignments', 'a = ' * N + '1;', 2*N + 4),
+    ('conditionals', 'x = ' + 'a ? b : ' * N + 'c;', 3*N + 6),
+    ('prefixes', 'x = ' + '!' * N + 'y;', N + 6),
+    ('else ifs', 'if (a) b; ' + 'else if (a) b; ' * (N/10) + 'else c;', 4*(N/10) + 8)]:
+  print name
+  open('stress.js', 'w').write(js)
+  out, err = Popen(['./cashew', '--stack=256', 'stress.js'], stdout=PIPE).communicate()
+  assert out == '%d nodes\n' % nodes, out
+os.unlink('stress.js')
+
+print 'errors'
+
+for js, expected in [
+    ('x = (1 + 2;', 'unexpected token at 10, expected )'),
+    ('x = 1 @ 2;', 'bad character at 6'),
+    ('x = "abc', 'unexpected end at 8, expected "'),
+    ('var 1 = 2;', 'unexpected token at 4, expected identifier'),
+    ('var x == 1;', 'unexpected token at 7, expected expression'),
+    ('switch (x) { case y: break; }', 'unexpected token at 18, expected number'),
+    ('function f() { return 1 ', 'unexpected end at 24, expected ;'),
+    ('function m() {\n  function a() { return 1; }\n  function b(x) { x = x | ; }\n  return a;\n}\n', 'unexpected token at 70, expected expression'),
+    ('function m() {\n  function a() { return 1; }\n  function b(x) { x = x | 0; }\n  return a +;\n}\n', 'unexpected token at 87, expected expression')]:
+  open('error.js', 'w').write(js)
+  for options in [[], ['--prelex'], ['--lazy'], ['--parallel=4'], ['--stream=7'], ['--stack=256']]:
+    out, err = Popen(['./cashew'] + options + ['error.js'], stdout=PIPE).communicate()
+    assert out == 'error: %s\n' % expected, out
+os.unlink('error.js')
+
+print 'interned strings'
+
+out, err = Popen(['./cashew', '--istrings'], stdout=PIPE).communicate()
+assert out == 'ok\n', out
+
+print 'node tags'
+
+out, err = Popen(['./cashew', '--tags'], stdout=PIPE).communicate()
+assert out == 'ok\n', out
+
+print 'asm.js types'
+
+out, err = Popen(['./cashew', '--types'], stdout=PIPE).communicate()
+assert out == 'ok\n', out
+
+print 'numbers'
+
+out, err = Popen(['./cashew', '--numbers'], stdout=PIPE).communicate()
+assert out == 'ok\n', out
+
+print 'threads interning strings'
+
+proc = Popen(['./cashew-bench', 'threads', '../samples/1.js'], stdout=PIPE)
+out, err = proc.communicate()
+assert proc.returncode == 0 and 'threads agree' in out, out
 
 print 'ok.'
 
+